@@ -1,29 +1,6 @@
-#include "emu8080.h"
-
-// this array defines the number of cycles one opcode takes.
-// note that there are some special cases: conditional RETs and CALLs
-// add +6 cycles if the condition is met
-// clang-format off
-static const uint8_t OPCODES_CYCLES[256] = {
-    //  0  1   2   3   4   5   6   7   8  9   A   B   C   D   E  F
-        4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 0
-        4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 1
-        4, 10, 16, 5,  5,  5,  7,  4,  4, 10, 16, 5,  5,  5,  7, 4,  // 2
-        4, 10, 13, 5,  10, 10, 10, 4,  4, 10, 13, 5,  5,  5,  7, 4,  // 3
-        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 4
-        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 5
-        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 6
-        7, 7,  7,  7,  7,  7,  7,  7,  5, 5,  5,  5,  5,  5,  7, 5,  // 7
-        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // 8
-        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // 9
-        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // A
-        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // B
-        5, 10, 10, 10, 11, 11, 7,  11, 5, 10, 10, 10, 11, 17, 7, 11, // C
-        5, 10, 10, 10, 11, 11, 7,  11, 5, 10, 10, 10, 11, 17, 7, 11, // D
-        5, 10, 10, 18, 11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11, // E
-        5, 10, 10, 4,  11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11  // F
-};
-// clang-format on
+#include <string.h>
+#include "emu8080_ops.h"
+#include "emu8080_hooks.h"
 
 static const char* DISASSEMBLE_TABLE[] = { "nop", "lxi b,#", "stax b", "inx b",
     "inr b", "dcr b", "mvi b,#", "rlc", "ill", "dad b", "ldax b", "dcx b",
@@ -59,323 +36,10 @@ static const char* DISASSEMBLE_TABLE[] = { "nop", "lxi b,#", "stax b", "inx b",
     "rst 5", "rp", "pop psw", "jp $", "di", "cp $", "push psw", "ori #",
     "rst 6", "rm", "sphl", "jm $", "ei", "cm $", "ill", "cpi #", "rst 7" };
 
-#define SET_ZSP(c, val) \
-  do { \
-    c->zf = (val) == 0; \
-    c->sf = (val) >> 7; \
-    c->pf = parity(val); \
-  } while (0)
-
-// memory helpers (the only four to use `read_byte` and `write_byte` function
-// pointers)
-
-// reads a byte from memory
-static inline uint8_t i8080_rb(i8080* const c, uint16_t addr) {
-    return c->read_byte(c->userdata, addr);
-}
-
-// writes a byte to memory
-static inline void i8080_wb(i8080* const c, uint16_t addr, uint8_t val) {
-    c->write_byte(c->userdata, addr, val);
-}
-
-// reads a word from memory
-static inline uint16_t i8080_rw(i8080* const c, uint16_t addr) {
-    return c->read_byte(c->userdata, addr + 1) << 8 |
-        c->read_byte(c->userdata, addr);
-}
-
-// writes a word to memory
-static inline void i8080_ww(i8080* const c, uint16_t addr, uint16_t val) {
-    c->write_byte(c->userdata, addr, val & 0xFF);
-    c->write_byte(c->userdata, addr + 1, val >> 8);
-}
-
-// returns the next byte in memory (and updates the program counter)
-static inline uint8_t i8080_next_byte(i8080* const c) {
-    return i8080_rb(c, c->pc++);
-}
-
-// returns the next word in memory (and updates the program counter)
-static inline uint16_t i8080_next_word(i8080* const c) {
-    uint16_t result = i8080_rw(c, c->pc);
-    c->pc += 2;
-    return result;
-}
-
-// paired registers helpers (setters and getters)
-static inline void i8080_set_bc(i8080* const c, uint16_t val) {
-    c->b = val >> 8;
-    c->c = val & 0xFF;
-}
-
-static inline void i8080_set_de(i8080* const c, uint16_t val) {
-    c->d = val >> 8;
-    c->e = val & 0xFF;
-}
-
-static inline void i8080_set_hl(i8080* const c, uint16_t val) {
-    c->h = val >> 8;
-    c->l = val & 0xFF;
-}
-
-static inline uint16_t i8080_get_bc(i8080* const c) {
-    return (c->b << 8) | c->c;
-}
-
-static inline uint16_t i8080_get_de(i8080* const c) {
-    return (c->d << 8) | c->e;
-}
-
-static inline uint16_t i8080_get_hl(i8080* const c) {
-    return (c->h << 8) | c->l;
-}
-
-// stack helpers
-
-// pushes a value into the stack and updates the stack pointer
-static inline void i8080_push_stack(i8080* const c, uint16_t val) {
-    c->sp -= 2;
-    i8080_ww(c, c->sp, val);
-}
-
-// pops a value from the stack and updates the stack pointer
-static inline uint16_t i8080_pop_stack(i8080* const c) {
-    uint16_t val = i8080_rw(c, c->sp);
-    c->sp += 2;
-    return val;
-}
-
-// opcodes
-
-// returns the parity of byte: 0 if number of 1 bits in `val` is odd, else 1
-static inline bool parity(uint8_t val) {
-    uint8_t nb_one_bits = 0;
-    for (int i = 0; i < 8; i++) {
-        nb_one_bits += ((val >> i) & 1);
-    }
-
-    return (nb_one_bits & 1) == 0;
-}
-
-// returns if there was a carry between bit "bit_no" and "bit_no - 1" when
-// executing "a + b + cy"
-static inline bool carry(int bit_no, uint8_t a, uint8_t b, bool cy) {
-    int16_t result = a + b + cy;
-    int16_t carry = result ^ a ^ b;
-    return carry & (1 << bit_no);
-}
-
-// adds a value (+ an optional carry flag) to a register
-static inline void i8080_add(
-    i8080* const c, uint8_t* const reg, uint8_t val, bool cy) {
-    uint8_t result = *reg + val + cy;
-    c->cf = carry(8, *reg, val, cy);
-    c->hf = carry(4, *reg, val, cy);
-    SET_ZSP(c, result);
-    *reg = result;
-}
-
-// substracts a byte (+ an optional carry flag) from a register
-// see https://stackoverflow.com/a/8037485
-static inline void i8080_sub(
-    i8080* const c, uint8_t* const reg, uint8_t val, bool cy) {
-    i8080_add(c, reg, ~val, !cy);
-    c->cf = !c->cf;
-}
-
-// adds a word to HL
-static inline void i8080_dad(i8080* const c, uint16_t val) {
-    c->cf = ((i8080_get_hl(c) + val) >> 16) & 1;
-    i8080_set_hl(c, i8080_get_hl(c) + val);
-}
-
-// increments a byte
-static inline uint8_t i8080_inr(i8080* const c, uint8_t val) {
-    uint8_t result = val + 1;
-    c->hf = (result & 0xF) == 0;
-    SET_ZSP(c, result);
-    return result;
-}
-
-// decrements a byte
-static inline uint8_t i8080_dcr(i8080* const c, uint8_t val) {
-    uint8_t result = val - 1;
-    c->hf = !((result & 0xF) == 0xF);
-    SET_ZSP(c, result);
-    return result;
-}
-
-// executes a logic "and" between register A and a byte, then stores the
-// result in register A
-static inline void i8080_ana(i8080* const c, uint8_t val) {
-    uint8_t result = c->a & val;
-    c->cf = 0;
-    c->hf = ((c->a | val) & 0x08) != 0;
-    SET_ZSP(c, result);
-    c->a = result;
-}
-
-// executes a logic "xor" between register A and a byte, then stores the
-// result in register A
-static inline void i8080_xra(i8080* const c, uint8_t val) {
-    c->a ^= val;
-    c->cf = 0;
-    c->hf = 0;
-    SET_ZSP(c, c->a);
-}
-
-// executes a logic "or" between register A and a byte, then stores the
-// result in register A
-static inline void i8080_ora(i8080* const c, uint8_t val) {
-    c->a |= val;
-    c->cf = 0;
-    c->hf = 0;
-    SET_ZSP(c, c->a);
-}
-
-// compares the register A to another byte
-static inline void i8080_cmp(i8080* const c, uint8_t val) {
-    int16_t result = c->a - val;
-    c->cf = result >> 8;
-    c->hf = ~(c->a ^ result ^ val) & 0x10;
-    SET_ZSP(c, result & 0xFF);
-}
-
-// sets the program counter to a given address
-static inline void i8080_jmp(i8080* const c, uint16_t addr) {
-    c->pc = addr;
-}
-
-// jumps to next address pointed by the next word in memory if a condition
-// is met
-static inline void i8080_cond_jmp(i8080* const c, bool condition) {
-    uint16_t addr = i8080_next_word(c);
-    if (condition) {
-        c->pc = addr;
-    }
-}
-
-// pushes the current pc to the stack, then jumps to an address
-static inline void i8080_call(i8080* const c, uint16_t addr) {
-    i8080_push_stack(c, c->pc);
-    i8080_jmp(c, addr);
-}
-
-// calls to next word in memory if a condition is met
-static inline void i8080_cond_call(i8080* const c, bool condition) {
-    uint16_t addr = i8080_next_word(c);
-    if (condition) {
-        i8080_call(c, addr);
-        c->cyc += 6;
-    }
-}
-
-// returns from subroutine
-static inline void i8080_ret(i8080* const c) {
-    c->pc = i8080_pop_stack(c);
-}
-
-// returns from subroutine if a condition is met
-static inline void i8080_cond_ret(i8080* const c, bool condition) {
-    if (condition) {
-        i8080_ret(c);
-        c->cyc += 6;
-    }
-}
-
-// pushes register A and the flags into the stack
-static inline void i8080_push_psw(i8080* const c) {
-    // note: bit 3 and 5 are always 0
-    uint8_t psw = 0;
-    psw |= c->sf << 7;
-    psw |= c->zf << 6;
-    psw |= c->hf << 4;
-    psw |= c->pf << 2;
-    psw |= 1 << 1; // bit 1 is always 1
-    psw |= c->cf << 0;
-    i8080_push_stack(c, c->a << 8 | psw);
-}
-
-// pops register A and the flags from the stack
-static inline void i8080_pop_psw(i8080* const c) {
-    uint16_t af = i8080_pop_stack(c);
-    c->a = af >> 8;
-    uint8_t psw = af & 0xFF;
-
-    c->sf = (psw >> 7) & 1;
-    c->zf = (psw >> 6) & 1;
-    c->hf = (psw >> 4) & 1;
-    c->pf = (psw >> 2) & 1;
-    c->cf = (psw >> 0) & 1;
-}
-
-// rotate register A left
-static inline void i8080_rlc(i8080* const c) {
-    c->cf = c->a >> 7;
-    c->a = (c->a << 1) | c->cf;
-}
-
-// rotate register A right
-static inline void i8080_rrc(i8080* const c) {
-    c->cf = c->a & 1;
-    c->a = (c->a >> 1) | (c->cf << 7);
-}
-
-// rotate register A left with the carry flag
-static inline void i8080_ral(i8080* const c) {
-    bool cy = c->cf;
-    c->cf = c->a >> 7;
-    c->a = (c->a << 1) | cy;
-}
-
-// rotate register A right with the carry flag
-static inline void i8080_rar(i8080* const c) {
-    bool cy = c->cf;
-    c->cf = c->a & 1;
-    c->a = (c->a >> 1) | (cy << 7);
-}
-
-// Decimal Adjust Accumulator: the eight-bit number in register A is adjusted
-// to form two four-bit binary-coded-decimal digits.
-// For example, if A=$2B and DAA is executed, A becomes $31.
-static inline void i8080_daa(i8080* const c) {
-    bool cy = c->cf;
-    uint8_t correction = 0;
-
-    uint8_t lsb = c->a & 0x0F;
-    uint8_t msb = c->a >> 4;
-
-    if (c->hf || lsb > 9) {
-        correction += 0x06;
-    }
-
-    if (c->cf || msb > 9 || (msb >= 9 && lsb > 9)) {
-        correction += 0x60;
-        cy = 1;
-    }
-
-    i8080_add(c, &c->a, correction, 0);
-    c->cf = cy;
-}
-
-// switches the value of registers DE and HL
-static inline void i8080_xchg(i8080* const c) {
-    uint16_t de = i8080_get_de(c);
-    i8080_set_de(c, i8080_get_hl(c));
-    i8080_set_hl(c, de);
-}
-
-// switches the value of a word at (sp) and HL
-static inline void i8080_xthl(i8080* const c) {
-    uint16_t val = i8080_rw(c, c->sp);
-    i8080_ww(c, c->sp, i8080_get_hl(c));
-    i8080_set_hl(c, val);
-}
-
 // executes one opcode
 static inline void i8080_execute(i8080* const c, uint8_t opcode) {
     c->cyc += OPCODES_CYCLES[opcode];
+    STAT(c->stats.instructions++);
 
     // when DI is executed, interrupts won't be serviced
     // until the end of next instruction:
@@ -678,8 +342,12 @@ static inline void i8080_execute(i8080* const c, uint8_t opcode) {
     case 0xE1: i8080_set_hl(c, i8080_pop_stack(c)); break; // POP H
     case 0xF1: i8080_pop_psw(c); break; // POP PSW
 
-    case 0xDB: c->a = c->port_in(c->userdata, i8080_next_byte(c)); break; // IN
-    case 0xD3: c->port_out(c->userdata, i8080_next_byte(c), c->a); break; // OUT
+    case 0xDB:
+        c->a = i8080_in(c, STAT_PORT(c->stats.ports_in, i8080_next_byte(c)));
+        break; // IN
+    case 0xD3:
+        i8080_out(c, STAT_PORT(c->stats.ports_out, i8080_next_byte(c)), c->a);
+        break; // OUT
 
     case 0x08:
     case 0x10:
@@ -699,6 +367,488 @@ static inline void i8080_execute(i8080* const c, uint8_t opcode) {
     }
 }
 
+// superinstructions
+
+#define BIT_TEST(bitmap, n) (((bitmap)[(n) >> 5] >> ((n) & 31)) & 1)
+#define BIT_SET(bitmap, n) ((bitmap)[(n) >> 5] |= 1u << ((n) & 31))
+
+// returns a pointer to the register encoded in the 3 low bits of `idx`
+// (B, C, D, E, H, L, M, A), NULL for M
+static inline uint8_t* i8080_reg(i8080* const c, uint8_t idx) {
+    switch (idx & 7) {
+    case 0: return &c->b;
+    case 1: return &c->c;
+    case 2: return &c->d;
+    case 3: return &c->e;
+    case 4: return &c->h;
+    case 5: return &c->l;
+    case 6: return NULL;
+    default: return &c->a;
+    }
+}
+
+// returns true for the fusable conditional jumps (JNZ, JZ, JNC, JC)
+static inline bool i8080_is_jcc(uint8_t opcode) {
+    return opcode == 0xC2 || opcode == 0xCA || opcode == 0xD2 || opcode == 0xDA;
+}
+
+// returns the condition of a fusable conditional jump
+static inline bool i8080_jcc_condition(i8080* const c, uint8_t opcode) {
+    switch (opcode) {
+    case 0xC2: return c->zf == 0; // JNZ
+    case 0xCA: return c->zf == 1; // JZ
+    case 0xD2: return c->cf == 0; // JNC
+    default: return c->cf == 1; // JC
+    }
+}
+
+// returns true if a pair of opcodes has a fused handler:
+// DCR r/JNZ, CMP r/Jcc, CPI/Jcc (Jcc being one of JNZ, JZ, JNC, JC),
+// MOV A,M/INX H, MOV M,A/INX H, LDAX D/STAX B and LDAX B/STAX D
+bool i8080_fusion_supported(uint8_t op1, uint8_t op2) {
+    if ((op1 & 0xC7) == 0x05 && op1 != 0x35) {
+        return op2 == 0xC2;
+    }
+    if ((op1 & 0xF8) == 0xB8 || op1 == 0xFE) {
+        return i8080_is_jcc(op2);
+    }
+    return (op1 == 0x7E && op2 == 0x23) || (op1 == 0x77 && op2 == 0x23) ||
+        (op1 == 0x1A && op2 == 0x02) || (op1 == 0x0A && op2 == 0x12);
+}
+
+// returns true if `addr` is in a page flagged as memory-mapped io
+static inline bool i8080_is_mmio(const i8080_fusion* const f, uint16_t addr) {
+    return BIT_TEST(f->mmio_pages, addr >> 8);
+}
+
+// executes a fused pair, `op1` having been fetched already. Returns false
+// (without side effects) if the pair has to be split because it accesses
+// memory-mapped io.
+static bool i8080_execute_pair(i8080* const c, uint8_t op1, uint8_t op2) {
+    const i8080_fusion* const f = c->fusion;
+    uint16_t hl = i8080_get_hl(c);
+
+    switch (op1) {
+    case 0xBE:
+    case 0x7E:
+    case 0x77:
+        if (i8080_is_mmio(f, hl)) {
+            return false;
+        }
+        break;
+    case 0x1A:
+    case 0x0A:
+        if (i8080_is_mmio(f, i8080_get_bc(c)) ||
+            i8080_is_mmio(f, i8080_get_de(c))) {
+            return false;
+        }
+        break;
+    }
+
+    c->cyc += OPCODES_CYCLES[op1] + OPCODES_CYCLES[op2];
+    c->interrupt_delay = c->interrupt_delay > 2 ? c->interrupt_delay - 2 : 0;
+    STAT(c->stats.instructions += 2);
+
+    if ((op1 & 0xC7) == 0x05) { // DCR r / JNZ
+        uint8_t* const reg = i8080_reg(c, op1 >> 3);
+        *reg = i8080_dcr(c, *reg);
+        c->pc += 1;
+        i8080_cond_jmp(c, c->zf == 0);
+    }
+    else if ((op1 & 0xF8) == 0xB8) { // CMP r / Jcc
+        uint8_t* const reg = i8080_reg(c, op1);
+        i8080_cmp(c, reg != NULL ? *reg : i8080_rb(c, hl));
+        c->pc += 1;
+        i8080_cond_jmp(c, i8080_jcc_condition(c, op2));
+    }
+    else if (op1 == 0xFE) { // CPI byte / Jcc
+        i8080_cmp(c, i8080_next_byte(c));
+        c->pc += 1;
+        i8080_cond_jmp(c, i8080_jcc_condition(c, op2));
+    }
+    else {
+        switch (op1) {
+        case 0x7E: c->a = i8080_rb(c, hl); break; // MOV A,M / INX H
+        case 0x77: i8080_wb(c, hl, c->a); break; // MOV M,A / INX H
+        case 0x1A: // LDAX D / STAX B
+            c->a = i8080_rb(c, i8080_get_de(c));
+            i8080_wb(c, i8080_get_bc(c), c->a);
+            break;
+        case 0x0A: // LDAX B / STAX D
+            c->a = i8080_rb(c, i8080_get_bc(c));
+            i8080_wb(c, i8080_get_de(c), c->a);
+            break;
+        }
+        if (op2 == 0x23) {
+            i8080_set_hl(c, hl + 1);
+        }
+        c->pc += 1;
+    }
+
+    return true;
+}
+
+// called for each instruction when superinstructions are on: profiles the
+// pairs executed and runs the enabled ones fused, unless an interrupt could
+// be serviced or a user event is scheduled between the two. Returns false if
+// `opcode` still has to be executed.
+static bool i8080_fusion_execute(i8080* const c, uint8_t opcode) {
+    i8080_fusion* const f = c->fusion;
+
+    if (f->pair_counts != NULL && f->has_last) {
+        f->pair_counts[f->last_opcode << 8 | opcode] += 1;
+    }
+    if (f->triple_counts != NULL && f->has_last && f->last_pair >= 0) {
+        f->triple_counts[f->last_pair << 8 | opcode] += 1;
+    }
+    f->last_opcode = opcode;
+    f->has_last = true;
+    f->last_pair = -1;
+
+    if (!BIT_TEST(f->enabled_first, opcode)) {
+        return false;
+    }
+
+    // CPI is the only first opcode with an operand. The second opcode is
+    // peeked through i8080_rb (read again by its own fetch if the pair is not
+    // fused), and not at all on a memory-mapped io page where reading could
+    // have side effects.
+    uint16_t op2_addr = c->pc + (opcode == 0xFE);
+    if (i8080_is_mmio(f, op2_addr)) {
+        return false;
+    }
+    uint8_t op2 = i8080_rb(c, op2_addr);
+    if (!BIT_TEST(f->enabled, opcode << 8 | op2)) {
+        return false;
+    }
+
+    unsigned long op2_start = c->cyc + OPCODES_CYCLES[opcode];
+    // never fused across an interrupt or an event, nor with a write log (each
+    // write is credited to its own instruction), nor when op1 overwrites op2
+    // (the peeked opcode would be stale) or op2 is a hooked routine
+    bool in_window = c->write_log != NULL ||
+        (c->interrupt_pending && c->iff) ||
+        (c->next_event != 0 && (long)(c->next_event - op2_start) <= 0) ||
+        (opcode == 0x77 && i8080_get_hl(c) == op2_addr) ||
+        (c->hooks != NULL && BIT_TEST(c->hooks->addresses, op2_addr));
+
+    if (in_window || !i8080_execute_pair(c, opcode, op2)) {
+        f->split += 1;
+        return false;
+    }
+
+    f->fused += 1;
+    if (f->pair_counts != NULL) {
+        f->pair_counts[opcode << 8 | op2] += 1;
+    }
+    if (f->triple_counts != NULL) {
+        for (int i = 0; i < f->nb_triple_pairs; i++) {
+            if (f->triple_pairs[i] == (opcode << 8 | op2)) {
+                f->last_pair = i;
+                break;
+            }
+        }
+    }
+    f->last_opcode = op2;
+    return true;
+}
+
+// initialises superinstructions with no pair enabled
+void i8080_fusion_init(i8080_fusion* const f) {
+    memset(f, 0, sizeof(*f));
+    f->last_pair = -1;
+}
+
+// enables the fusion of a pair (if it is supported)
+void i8080_fusion_enable(i8080_fusion* const f, uint8_t op1, uint8_t op2) {
+    if (!i8080_fusion_supported(op1, op2) || BIT_TEST(f->enabled, op1 << 8 | op2)) {
+        return;
+    }
+    BIT_SET(f->enabled, op1 << 8 | op2);
+    BIT_SET(f->enabled_first, op1);
+    if (f->nb_triple_pairs < I8080_FUSION_TRIPLE_PAIRS) {
+        f->triple_pairs[f->nb_triple_pairs++] = op1 << 8 | op2;
+    }
+}
+
+// returns the number of times `op3` was executed right after the fused pair
+// `op1`, `op2` (0 if the pair is not profiled)
+uint32_t i8080_fusion_triple_count(const i8080_fusion* const f, uint8_t op1,
+    uint8_t op2, uint8_t op3) {
+    if (f->triple_counts == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < f->nb_triple_pairs; i++) {
+        if (f->triple_pairs[i] == (op1 << 8 | op2)) {
+            return f->triple_counts[i << 8 | op3];
+        }
+    }
+    return 0;
+}
+
+// enables the (at most) `max_pairs` supported pairs executed the most often
+// according to the profile, returns the number of pairs enabled
+int i8080_fusion_select(i8080_fusion* const f, int max_pairs) {
+    int nb_enabled = 0;
+
+    memset(f->enabled, 0, sizeof(f->enabled));
+    memset(f->enabled_first, 0, sizeof(f->enabled_first));
+    f->nb_triple_pairs = 0;
+    f->last_pair = -1;
+    if (f->triple_counts != NULL) { // the ranks of the pairs change
+        memset(f->triple_counts, 0,
+            I8080_FUSION_TRIPLE_PAIRS * 256 * sizeof(f->triple_counts[0]));
+    }
+    if (f->pair_counts == NULL) {
+        return 0;
+    }
+
+    while (nb_enabled < max_pairs) {
+        int best = -1;
+        uint32_t best_count = 0;
+        for (int pair = 0; pair < 256 * 256; pair++) {
+            if (f->pair_counts[pair] > best_count && !BIT_TEST(f->enabled, pair) &&
+                i8080_fusion_supported(pair >> 8, pair & 0xFF)) {
+                best = pair;
+                best_count = f->pair_counts[pair];
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        i8080_fusion_enable(f, best >> 8, best & 0xFF);
+        nb_enabled++;
+    }
+
+    return nb_enabled;
+}
+
+// block move idioms
+
+// returns a byte of code read from the mapped memory, -1 if not mapped
+static inline int i8080_idiom_peek(const i8080_idioms* const m, uint16_t addr) {
+    const uint8_t* const page = m->read_pages[addr >> 8];
+    return page != NULL ? page[addr & 0xFF] : -1;
+}
+
+// returns true if [a, a + a_len) and [b, b + b_len) intersect (64K wrapping)
+static inline bool i8080_ranges_overlap(
+    uint16_t a, unsigned a_len, uint16_t b, unsigned b_len) {
+    return (uint16_t)(b - a) < a_len || (uint16_t)(a - b) < b_len;
+}
+
+// returns true if all the pages of [addr, addr + len) are mapped
+static inline bool i8080_is_mapped(
+    uint8_t* const* pages, uint16_t addr, unsigned len) {
+    return pages[addr >> 8] != NULL &&
+        pages[(uint16_t)(addr + len - 1) >> 8] != NULL;
+}
+
+// called after a backward jump to `c->pc`: if it closes a byte copy or fill
+// loop, runs the iterations left (or as many as fit before `next_event`) as
+// one block move. The loop body is made of:
+//   - an optional load of A: LDAX B, LDAX D or MOV A,M,
+//   - a store: STAX B, STAX D, MOV M,A or MVI M,byte,
+//   - one INX of each pair used, after its access,
+//   - DCR r (r being B, C, D or E and not in a pair used) then JNZ to the
+//     start of the loop.
+// Returns false (without side effects) if the loop does not match or can't
+// be run directly.
+static bool i8080_idiom_execute(i8080* const c) {
+    i8080_idioms* const m = c->idioms;
+    const uint16_t start = c->pc;
+    int load = -1; // pair the byte is loaded from (0: BC, 1: DE, 2: HL)
+    int store = -1; // pair the byte is stored to
+    int immediate = -1; // byte stored by MVI M
+    bool incremented[3] = { false, false, false };
+    int counter = -1; // register decremented (0: B, 1: C, 2: D, 3: E)
+    unsigned long cycles = 0; // per iteration
+    int nb_instructions = 0;
+    uint16_t addr = start;
+
+    if (c->write_log != NULL || (c->interrupt_pending && c->iff)) {
+        return false;
+    }
+
+    while (counter < 0) {
+        int op = i8080_idiom_peek(m, addr);
+        if (op < 0 || nb_instructions == 8) {
+            return false;
+        }
+        cycles += OPCODES_CYCLES[op];
+        nb_instructions += 1;
+        addr += 1;
+
+        if (op == 0x0A || op == 0x1A || op == 0x7E) { // LDAX B/D, MOV A,M
+            if (load >= 0 || store >= 0) {
+                return false;
+            }
+            load = op == 0x7E ? 2 : op >> 4;
+        }
+        else if (op == 0x02 || op == 0x12 || op == 0x77 || op == 0x36) {
+            if (store >= 0) {
+                return false;
+            }
+            store = op == 0x77 || op == 0x36 ? 2 : op >> 4;
+            if (op == 0x36) { // MVI M,byte
+                immediate = i8080_idiom_peek(m, addr);
+                addr += 1;
+                if (immediate < 0 || load >= 0) {
+                    return false;
+                }
+            }
+        }
+        else if (op == 0x03 || op == 0x13 || op == 0x23) { // INX B/D/H
+            int pair = op >> 4;
+            if (incremented[pair] || (pair != load && pair != store)) {
+                return false;
+            }
+            incremented[pair] = true;
+        }
+        else if (op == 0x05 || op == 0x0D || op == 0x15 || op == 0x1D) {
+            counter = op >> 3; // DCR B/C/D/E
+        }
+        else {
+            return false;
+        }
+    }
+
+    // JNZ start, the instruction just executed (fused with the DCR or not)
+    uint16_t jnz = addr;
+    if (i8080_idiom_peek(m, jnz) != 0xC2 ||
+        i8080_idiom_peek(m, jnz + 1) != (start & 0xFF) ||
+        i8080_idiom_peek(m, jnz + 2) != start >> 8 ||
+        (c->inst_pc != jnz && c->inst_pc != (uint16_t)(jnz - 1))) {
+        return false;
+    }
+    cycles += OPCODES_CYCLES[0xC2];
+    nb_instructions += 1;
+
+    // a hooked routine in the loop is run by its handler
+    unsigned code_len = (uint16_t)(jnz + 3 - start);
+    for (unsigned i = 0; c->hooks != NULL && i < code_len; i++) {
+        if (BIT_TEST(c->hooks->addresses, (uint16_t)(start + i))) {
+            return false;
+        }
+    }
+
+    if (store < 0 || load == store || !incremented[store] ||
+        (load >= 0 && !incremented[load]) ||
+        counter >> 1 == load || counter >> 1 == store) {
+        return false;
+    }
+
+    // iterations left, limited to the ones that end before the next event
+    uint8_t* const reg = i8080_reg(c, (uint8_t)counter);
+    unsigned n = *reg;
+    if (c->next_event != 0) {
+        long left = (long)(c->next_event - c->cyc);
+        if (left <= 0) {
+            return false;
+        }
+        if ((unsigned long)left / cycles < n) {
+            n = (unsigned)((unsigned long)left / cycles);
+        }
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    uint16_t pairs[3] = { i8080_get_bc(c), i8080_get_de(c), i8080_get_hl(c) };
+    uint16_t dst = pairs[store];
+    uint16_t src = load >= 0 ? pairs[load] : 0;
+    if (!i8080_is_mapped(m->write_pages, dst, n) ||
+        (load >= 0 && !i8080_is_mapped(m->read_pages, src, n)) ||
+        i8080_ranges_overlap(dst, n, start, code_len)) {
+        return false;
+    }
+
+    // the move, page by page (a copy onto its own source is done forward,
+    // byte by byte, like the loop)
+    bool overlap = load >= 0 && i8080_ranges_overlap(src, n, dst, n);
+    uint8_t fill = immediate >= 0 ? (uint8_t)immediate : c->a;
+    uint8_t a = c->a;
+    unsigned done = 0;
+    while (done < n) {
+        uint16_t d = dst + done;
+        unsigned len = n - done;
+        len = len < 256u - (d & 0xFF) ? len : 256u - (d & 0xFF);
+        uint8_t* const out = &m->write_pages[d >> 8][d & 0xFF];
+
+        if (load < 0) {
+            memset(out, fill, len);
+        }
+        else {
+            uint16_t s = src + done;
+            len = len < 256u - (s & 0xFF) ? len : 256u - (s & 0xFF);
+            const uint8_t* const in = &m->read_pages[s >> 8][s & 0xFF];
+            if (overlap) {
+                for (unsigned i = 0; i < len; i++) {
+                    a = in[i];
+                    out[i] = a;
+                }
+            }
+            else {
+                memcpy(out, in, len);
+                a = in[len - 1];
+            }
+            STAT(c->stats.reads[s >> 8] += len);
+        }
+
+        MARK_DIRTY(c, d);
+        STAT(c->stats.writes[d >> 8] += len);
+        done += len;
+    }
+
+#ifdef I8080_STATS
+    c->stats.instructions += (uint64_t)n * nb_instructions;
+    for (unsigned i = 0; i < code_len; i++) {
+        c->stats.reads[(uint16_t)(start + i) >> 8] += n; // fetches
+    }
+#endif
+
+    for (int pair = 0; pair < 3; pair++) {
+        pairs[pair] += incremented[pair] ? n : 0;
+    }
+    i8080_set_bc(c, pairs[0]);
+    i8080_set_de(c, pairs[1]);
+    i8080_set_hl(c, pairs[2]);
+    if (load >= 0) {
+        c->a = a;
+    }
+    // the flags are the ones of the last DCR
+    *reg = i8080_dcr(c, (uint8_t)(*reg - n + 1));
+    c->pc = *reg == 0 ? jnz + 3 : start;
+    c->cyc += n * cycles;
+    c->interrupt_delay = 0;
+
+    m->loops += 1;
+    m->iterations += n;
+    return true;
+}
+
+// initialises the block move idioms with no memory mapped
+void i8080_idioms_init(i8080_idioms* const m) {
+    memset(m, 0, sizeof(*m));
+}
+
+// maps the pages of [addr, addr + size) to host memory (`memory` holding the
+// byte at `addr`). Writable pages must be the memory written by `write_byte`
+// (and readable pages, the memory read by `read_byte`). Returns false, and
+// maps nothing, unless `addr` and `size` are multiples of 256 within 64 KiB.
+bool i8080_idioms_map(i8080_idioms* const m, uint16_t addr, size_t size,
+    uint8_t* memory, bool writable) {
+    if ((addr & 0xFF) != 0 || (size & 0xFF) != 0 || size > 0x10000u - addr) {
+        return false;
+    }
+    for (size_t offset = 0; offset < size; offset += 256) {
+        int page = ((addr + offset) >> 8) & 0xFF;
+        m->read_pages[page] = &memory[offset];
+        m->write_pages[page] = writable ? &memory[offset] : NULL;
+    }
+    return true;
+}
+
 // initialises the emulator with default values
 void i8080_init(i8080* const c) {
     c->read_byte = NULL;
@@ -706,6 +856,7 @@ void i8080_init(i8080* const c) {
     c->port_in = NULL;
     c->port_out = NULL;
     c->userdata = NULL;
+    c->ports = NULL;
 
     c->cyc = 0;
 
@@ -731,26 +882,91 @@ void i8080_init(i8080* const c) {
     c->interrupt_pending = 0;
     c->interrupt_vector = 0;
     c->interrupt_delay = 0;
+
+    memset(c->dirty_pages, 0, sizeof(c->dirty_pages));
+    c->next_event = 0;
+    c->fusion = NULL;
+
+    c->inst_pc = 0;
+    c->write_log = NULL;
+    c->hooks = NULL;
+    c->idioms = NULL;
+
+#ifdef I8080_STATS
+    i8080_reset_stats(c);
+    c->interrupt_request_cyc = 0;
+#endif
+}
+
+#ifdef I8080_STATS
+// adds the latency of the interrupt being serviced to the histogram of its
+// vector
+static void i8080_record_latency(i8080* const c) {
+    uint8_t opcode = c->interrupt_vector;
+    int vector = (opcode & 0xC7) == 0xC7 ? (opcode >> 3) & 7 :
+        I8080_LATENCY_OTHER;
+    i8080_latency* const l = &c->stats.interrupt_latency[vector];
+    unsigned long cycles = c->cyc - c->interrupt_request_cyc;
+
+    int bucket = 0;
+    while (bucket < 31 && (cycles >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    l->count += 1;
+    l->total += cycles;
+    l->max = cycles > l->max ? cycles : l->max;
+    l->buckets[bucket] += 1;
 }
+#endif
 
 // executes one instruction
 void i8080_step(i8080* const c) {
+    c->inst_pc = c->pc;
+
     // interrupt processing: if an interrupt is pending and IFF is set,
     // we execute the interrupt vector passed by the user.
     if (c->interrupt_pending && c->iff && c->interrupt_delay == 0) {
         c->interrupt_pending = 0;
         c->iff = 0;
         c->halted = 0;
+        STAT(c->stats.interrupts_serviced++);
+        STAT(i8080_record_latency(c));
+        if (c->fusion != NULL) {
+            c->fusion->has_last = false;
+        }
 
         i8080_execute(c, c->interrupt_vector);
     }
     else if (!c->halted) {
-        i8080_execute(c, i8080_next_byte(c));
+        STAT(c->stats.interrupt_delay_stalls +=
+            c->interrupt_pending && c->iff);
+        if (c->hooks != NULL && BIT_TEST(c->hooks->addresses, c->pc) &&
+            i8080_hooks_call(c->hooks, c)) {
+            // a routine replaced by a native handler
+        }
+        else {
+            uint8_t opcode = i8080_next_byte(c);
+            if (c->fusion == NULL || !i8080_fusion_execute(c, opcode)) {
+                i8080_execute(c, opcode);
+            }
+            if (c->idioms != NULL && c->pc < c->inst_pc) {
+                i8080_idiom_execute(c);
+            }
+        }
+    }
+    else {
+        STAT(c->stats.halted_steps++);
     }
 }
 
 // asks for an interrupt to be serviced
 void i8080_interrupt(i8080* const c, uint8_t opcode) {
+    STAT(c->stats.interrupts_requested++);
+    STAT(c->stats.interrupts_overwritten += c->interrupt_pending);
+    // a request replacing a pending one keeps the cycle of the first: the
+    // latency is how long the interrupt has been waiting
+    STAT(c->interrupt_request_cyc =
+        c->interrupt_pending ? c->interrupt_request_cyc : c->cyc);
     c->interrupt_pending = 1;
     c->interrupt_vector = opcode;
 }
@@ -770,14 +986,115 @@ void i8080_debug_output(i8080* const c, bool print_disassembly) {
         c->pc, c->a << 8 | f, i8080_get_bc(c), i8080_get_de(c), i8080_get_hl(c),
         c->sp, c->cyc);
 
-    printf("\t(%02X %02X %02X %02X)", i8080_rb(c, c->pc), i8080_rb(c, c->pc + 1),
-        i8080_rb(c, c->pc + 2), i8080_rb(c, c->pc + 3));
+    // read without i8080_rb, so that tracing does not change the counters
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = c->read_byte(c->userdata, (uint16_t)(c->pc + i));
+    }
+    printf("\t(%02X %02X %02X %02X)", bytes[0], bytes[1], bytes[2], bytes[3]);
 
     if (print_disassembly) {
-        printf(" - %s", DISASSEMBLE_TABLE[i8080_rb(c, c->pc)]);
+        printf(" - %s", DISASSEMBLE_TABLE[bytes[0]]);
     }
 
     printf("\n");
 }
 
-#undef SET_ZSP
\ No newline at end of file
+#ifdef I8080_STATS
+// copies the counters into `stats` (a consistent snapshot as long as the cpu
+// is not stepped at the same time)
+void i8080_get_stats(const i8080* const c, i8080_stats* const stats) {
+    *stats = c->stats;
+}
+
+// sets all the counters back to zero
+void i8080_reset_stats(i8080* const c) {
+    memset(&c->stats, 0, sizeof(c->stats));
+}
+
+// returns an upper bound of the latency under which `fraction` (0 to 1) of
+// the latencies fall: the last cycle of the histogram bucket it is in (or
+// `max` if lower), not the exact percentile, the latencies being only kept
+// as power-of-two buckets
+unsigned long i8080_latency_percentile(
+    const i8080_latency* const latency, double fraction) {
+    uint64_t target = (uint64_t)(fraction * latency->count + 0.5);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < 32; bucket++) {
+        seen += latency->buckets[bucket];
+        if (seen >= target && seen > 0) {
+            unsigned long end = (2ul << bucket) - 1;
+            return end < latency->max ? end : latency->max;
+        }
+    }
+    return latency->max;
+}
+
+// writes the counters to `f` as text, one "name value" line per counter
+// (the per page and per port counters only when not zero, the interrupt
+// latencies only for the vectors that were serviced)
+void i8080_stats_export(const i8080* const c, FILE* f) {
+    const i8080_stats* const s = &c->stats;
+    static const char* const VECTORS[9] = { "rst0", "rst1", "rst2", "rst3",
+        "rst4", "rst5", "rst6", "rst7", "other" };
+
+    fprintf(f, "instructions %llu\n", (unsigned long long)s->instructions);
+    fprintf(f, "interrupts_requested %llu\n",
+        (unsigned long long)s->interrupts_requested);
+    fprintf(f, "interrupts_serviced %llu\n",
+        (unsigned long long)s->interrupts_serviced);
+    fprintf(f, "interrupts_overwritten %llu\n",
+        (unsigned long long)s->interrupts_overwritten);
+    fprintf(f, "interrupt_delay_stalls %llu\n",
+        (unsigned long long)s->interrupt_delay_stalls);
+    fprintf(f, "halted_steps %llu\n", (unsigned long long)s->halted_steps);
+
+    for (int i = 0; i < 256; i++) {
+        if (s->reads[i] != 0) {
+            fprintf(f, "reads.page%02X %llu\n", i,
+                (unsigned long long)s->reads[i]);
+        }
+        if (s->writes[i] != 0) {
+            fprintf(f, "writes.page%02X %llu\n", i,
+                (unsigned long long)s->writes[i]);
+        }
+        if (s->ports_in[i] != 0) {
+            fprintf(f, "ports_in.port%02X %llu\n", i,
+                (unsigned long long)s->ports_in[i]);
+        }
+        if (s->ports_out[i] != 0) {
+            fprintf(f, "ports_out.port%02X %llu\n", i,
+                (unsigned long long)s->ports_out[i]);
+        }
+    }
+
+    for (int v = 0; v < 9; v++) {
+        const i8080_latency* const l = &s->interrupt_latency[v];
+        if (l->count == 0) {
+            continue;
+        }
+        fprintf(f, "interrupt_latency.%s.count %llu\n", VECTORS[v],
+            (unsigned long long)l->count);
+        fprintf(f, "interrupt_latency.%s.mean %.1f\n", VECTORS[v],
+            (double)l->total / l->count);
+        fprintf(f, "interrupt_latency.%s.p50 %lu\n", VECTORS[v],
+            i8080_latency_percentile(l, 0.50));
+        fprintf(f, "interrupt_latency.%s.p99 %lu\n", VECTORS[v],
+            i8080_latency_percentile(l, 0.99));
+        fprintf(f, "interrupt_latency.%s.max %lu\n", VECTORS[v], l->max);
+        for (int b = 0; b < 32; b++) {
+            if (l->buckets[b] != 0) {
+                fprintf(f, "interrupt_latency.%s.bucket%02d %llu\n",
+                    VECTORS[v], b, (unsigned long long)l->buckets[b]);
+            }
+        }
+    }
+}
+#endif
+
+#undef SET_ZSP
+#undef STAT
+#undef STAT_PORT
+#undef MARK_DIRTY
+#undef BIT_TEST
+#undef BIT_SET
\ No newline at end of file
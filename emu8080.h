@@ -5,6 +5,84 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// define I8080_STATS (for every file including this header) to compile in the
+// hot path counters below; without it the cpu is left untouched.
+#ifdef I8080_STATS
+// histogram of the cycles between an interrupt request and its service. A
+// request replacing one still pending is timed from the first one. A halted
+// cpu does not advance `cyc` by itself: the latency of an interrupt ending a
+// HLT is only what the run loop added meanwhile (the pacer and the scheduler
+// move `cyc` to their next stop), 0 for a loop calling i8080_step alone.
+typedef struct i8080_latency {
+	uint64_t count;
+	uint64_t total; // cycles
+	unsigned long max;
+	uint64_t buckets[32]; // bucket n counts latencies in [2^n, 2^(n+1)) cycles
+	                      // (bucket 0 also counts 0)
+} i8080_latency;
+
+#define I8080_LATENCY_OTHER 8 // latency index of the vectors that are not RST
+
+typedef struct i8080_stats {
+	uint64_t instructions; // instructions retired
+	uint64_t reads[256]; // read_byte calls, per 256-byte page
+	uint64_t writes[256]; // write_byte calls, per 256-byte page
+	uint64_t ports_in[256]; // port_in calls, per port
+	uint64_t ports_out[256]; // port_out calls, per port
+	uint64_t interrupts_requested;
+	uint64_t interrupts_serviced;
+	// requests replaced by another one before being serviced (the vector of
+	// the last one wins)
+	uint64_t interrupts_overwritten;
+	// latency per vector: RST 0 to 7, then I8080_LATENCY_OTHER
+	i8080_latency interrupt_latency[9];
+	uint64_t interrupt_delay_stalls; // steps where interrupt_delay held one back
+	uint64_t halted_steps; // steps spent halted (the cycle count stands still)
+} i8080_stats;
+#endif
+
+// per-port handlers, see `ports` below
+typedef struct i8080_port {
+	uint8_t(*in)(void*, uint8_t); // NULL: falls back to port_in
+	void (*out)(void*, uint8_t, uint8_t); // NULL: falls back to port_out
+	void* in_userdata;
+	void* out_userdata;
+} i8080_port;
+
+#define I8080_FUSION_TRIPLE_PAIRS 32
+
+// superinstructions: pairs of opcodes executed by one fused handler, see
+// `fusion` below. Which pairs are fused is up to the user, usually picked
+// from a profile of the pairs executed (i8080_fusion_select). Triples are
+// only profiled, as extensions of the enabled pairs (the opcode executed
+// after a fused pair), for the first I8080_FUSION_TRIPLE_PAIRS pairs enabled.
+typedef struct i8080_fusion {
+	uint32_t* pair_counts; // optional 256*256 profile, indexed by op1 << 8 | op2
+	// optional I8080_FUSION_TRIPLE_PAIRS*256 profile, indexed by the rank of
+	// the pair in `triple_pairs` << 8 | op3 (see i8080_fusion_triple_count)
+	uint32_t* triple_counts;
+	uint16_t triple_pairs[I8080_FUSION_TRIPLE_PAIRS]; // op1 << 8 | op2
+	int nb_triple_pairs;
+	int last_pair; // rank of the pair just fused, -1 if none
+	uint32_t enabled[256 * 256 / 32]; // bitmap of the pairs to fuse
+	uint32_t enabled_first[256 / 32]; // bitmap of the first opcodes of those
+	uint32_t mmio_pages[256 / 32]; // pages with memory-mapped io (never fused)
+	uint64_t fused; // pairs executed fused
+	uint64_t split; // enabled pairs executed one instruction at a time
+	uint8_t last_opcode;
+	bool has_last; // false after an interrupt (no pair to count)
+} i8080_fusion;
+
+// block move idioms: byte copy and fill loops run as one memcpy/memset, see
+// `idioms` below. Memory is accessed directly through the pages mapped here;
+// loops touching other pages (e.g. memory-mapped io) are not batched.
+typedef struct i8080_idioms {
+	uint8_t* read_pages[256]; // host memory of each 256-byte page (NULL: none)
+	uint8_t* write_pages[256]; // same for writes (NULL for rom and io pages)
+	uint64_t loops; // loops run as block moves
+	uint64_t iterations; // loop iterations done by those
+} i8080_idioms;
+
 typedef struct i8080 {
 	// memory + io interface
 	uint8_t(*read_byte)(void*, uint16_t); // user function to read from memory
@@ -12,6 +90,7 @@ typedef struct i8080 {
 	uint8_t(*port_in)(void*, uint8_t); // user function to read from port
 	void (*port_out)(void*, uint8_t, uint8_t); // same for writing to port
 	void* userdata; // user custom pointer
+	i8080_port* ports; // optional 256-entry handler table, one per port
 
 	unsigned long cyc; // cycle count
 
@@ -24,6 +103,33 @@ typedef struct i8080 {
 	bool interrupt_pending : 1;
 	uint8_t interrupt_vector;
 	uint8_t interrupt_delay;
+
+	// bitmap of the 256-byte pages written since the user last cleared it
+	uint32_t dirty_pages[8];
+
+	// cycle of the next event scheduled by the user (e.g. an interrupt), 0 if
+	// none: instructions are never fused nor loops batched across it. A run
+	// loop stopping at a given cycle must set it (the pacer, the scheduler
+	// and the rewind seek do), or it can overshoot that cycle.
+	unsigned long next_event;
+	i8080_fusion* fusion; // optional superinstructions (NULL: off)
+
+	uint16_t inst_pc; // address of the instruction being executed
+	// optional history of the memory writes (NULL: off), see
+	// emu8080_writelog.h. Superinstructions are not used while it is set.
+	struct i8080_writelog* write_log;
+	// optional native handlers replacing routines (NULL: off), see
+	// emu8080_hooks.h
+	struct i8080_hooks* hooks;
+	// optional block move idioms (NULL: off). Loops are never batched past
+	// `next_event`, nor with a write log.
+	i8080_idioms* idioms;
+
+#ifdef I8080_STATS
+	i8080_stats stats;
+	// cycle of the first request still pending (see i8080_interrupt)
+	unsigned long interrupt_request_cyc;
+#endif
 } i8080;
 
 void i8080_init(i8080* const c);
@@ -31,4 +137,23 @@ void i8080_step(i8080* const c);
 void i8080_interrupt(i8080* const c, uint8_t opcode);
 void i8080_debug_output(i8080* const c, bool print_disassembly);
 
+void i8080_fusion_init(i8080_fusion* const f);
+bool i8080_fusion_supported(uint8_t op1, uint8_t op2);
+void i8080_fusion_enable(i8080_fusion* const f, uint8_t op1, uint8_t op2);
+int i8080_fusion_select(i8080_fusion* const f, int max_pairs);
+uint32_t i8080_fusion_triple_count(const i8080_fusion* const f, uint8_t op1,
+	uint8_t op2, uint8_t op3);
+
+void i8080_idioms_init(i8080_idioms* const m);
+bool i8080_idioms_map(i8080_idioms* const m, uint16_t addr, size_t size,
+	uint8_t* memory, bool writable);
+
+#ifdef I8080_STATS
+void i8080_get_stats(const i8080* const c, i8080_stats* const stats);
+void i8080_reset_stats(i8080* const c);
+unsigned long i8080_latency_percentile(const i8080_latency* const latency,
+	double fraction);
+void i8080_stats_export(const i8080* const c, FILE* f);
+#endif
+
 #endif // I8080_I8080_H_
\ No newline at end of file
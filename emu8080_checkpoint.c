@@ -0,0 +1,314 @@
+// Golden state-hash checkpoints for bit-exact regression runs.
+//
+// file format (all values little endian):
+//   "I8080CK1" (8 bytes), interval in cycles (8 bytes),
+//   then one record per checkpoint: cycle count (8 bytes), hash (8 bytes)
+
+#include <string.h>
+#include "emu8080_checkpoint.h"
+#include "emu8080_file.h"
+
+#define HEADER_SIZE 16
+#define RECORD_SIZE 16
+
+static const char MAGIC[8] = { 'I', '8', '0', '8', '0', 'C', 'K', '1' };
+
+// hash constants (the xxh64 primes)
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t val = 0;
+    for (int i = 7; i >= 0; i--) {
+        val = val << 8 | p[i];
+    }
+    return val;
+}
+
+static inline void write64(uint8_t* p, uint64_t val) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (val >> (8 * i)) & 0xFF;
+    }
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t lane) {
+    return rotl64(acc + lane * P2, 31) * P1;
+}
+
+// 64-bit hash in the spirit of xxh64: four independent lanes of 8 bytes per
+// 32-byte block (which the compiler can keep in registers or vectorise),
+// folded together and avalanched at the end
+static uint64_t hash64(const uint8_t* data, size_t len, uint64_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* const end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2;
+        uint64_t v2 = seed + P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    }
+    else {
+        h = seed + P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * P1 + P4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl64(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// hashes the cpu state and the 64 KiB of memory (read from `memory` if not
+// NULL, through the read_byte callback otherwise)
+uint64_t i8080_state_hash(i8080* const c, const uint8_t* memory) {
+    uint8_t regs[24];
+    regs[0] = c->pc & 0xFF;
+    regs[1] = c->pc >> 8;
+    regs[2] = c->sp & 0xFF;
+    regs[3] = c->sp >> 8;
+    regs[4] = c->a;
+    regs[5] = c->b;
+    regs[6] = c->c;
+    regs[7] = c->d;
+    regs[8] = c->e;
+    regs[9] = c->h;
+    regs[10] = c->l;
+    regs[11] = c->sf << 7 | c->zf << 6 | c->hf << 5 | c->pf << 4 | c->cf << 3 |
+        c->iff << 2 | c->halted << 1 | c->interrupt_pending;
+    regs[12] = c->interrupt_vector;
+    regs[13] = c->interrupt_delay;
+    write64(&regs[14], c->cyc);
+    regs[22] = regs[23] = 0;
+
+    // the memory is hashed page by page, each page hash seeding the next
+    uint8_t page[256];
+    uint64_t h = hash64(regs, sizeof(regs), 0);
+    for (int p = 0; p < 256; p++) {
+        const uint8_t* data = memory != NULL ? &memory[p << 8] : page;
+        if (memory == NULL) {
+            for (int i = 0; i < 256; i++) {
+                page[i] = c->read_byte(c->userdata, p << 8 | i);
+            }
+        }
+        h = hash64(data, sizeof(page), h);
+    }
+    return h;
+}
+
+// reads the header of a checkpoint file, returns its interval (0 if the file
+// is not a checkpoint file)
+static unsigned long read_header(FILE* f) {
+    uint8_t header[HEADER_SIZE];
+    if (fseek(f, 0, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, MAGIC, sizeof(MAGIC)) != 0) {
+        return 0;
+    }
+    return (unsigned long)read64(&header[8]);
+}
+
+// lowers c->next_event to the next checkpoint, so that fused pairs and
+// batched loops stop there as they do when run one instruction at a time
+// (the hashes are then taken at the same cycles). `previous` is the
+// checkpoint it was lowered to before, if any: an event the user scheduled
+// is kept if it comes first.
+static void schedule_checkpoint(
+    i8080_checkpoint* const ck, i8080* const c, unsigned long previous) {
+    if (c->next_event == previous || c->next_event == 0 ||
+        (long)(c->next_event - ck->next) > 0) {
+        c->next_event = ck->next;
+    }
+}
+
+// starts recording checkpoints, one every `interval` cycles from now
+bool i8080_checkpoint_record(i8080_checkpoint* const ck, const char* filename,
+    unsigned long interval, i8080* const c) {
+    memset(ck, 0, sizeof(*ck));
+    if (interval == 0) {
+        fprintf(stderr, "error: the checkpoint interval can't be 0.\n");
+        return false;
+    }
+    ck->file = i8080_open_file(filename, "wb");
+    if (ck->file == NULL) {
+        fprintf(stderr, "error: can't open file '%s'.\n", filename);
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    write64(&header[8], interval);
+    fwrite(header, 1, sizeof(header), ck->file);
+
+    ck->recording = true;
+    ck->interval = interval;
+    ck->next = c->cyc + interval;
+    schedule_checkpoint(ck, c, 0);
+    return true;
+}
+
+// starts comparing against a recorded checkpoint file
+bool i8080_checkpoint_compare(
+    i8080_checkpoint* const ck, const char* filename, i8080* const c) {
+    memset(ck, 0, sizeof(*ck));
+    ck->file = i8080_open_file(filename, "rb");
+    if (ck->file == NULL) {
+        fprintf(stderr, "error: can't open file '%s'.\n", filename);
+        return false;
+    }
+
+    ck->interval = read_header(ck->file);
+    if (ck->interval == 0) {
+        fprintf(stderr, "error: '%s' is not a checkpoint file.\n", filename);
+        fclose(ck->file);
+        ck->file = NULL;
+        return false;
+    }
+
+    ck->recording = false;
+    ck->next = c->cyc + ck->interval;
+    schedule_checkpoint(ck, c, 0);
+    return true;
+}
+
+// to be called after each step (or frame): writes or checks a checkpoint if
+// one is due. Returns false once the run has diverged from the recording, or
+// when the recording is over (`ended` set, nothing left to compare).
+bool i8080_checkpoint_tick(i8080_checkpoint* const ck, i8080* const c) {
+    if (ck->diverged || ck->ended) {
+        return false;
+    }
+    if ((long)(c->cyc - ck->next) < 0) {
+        return true;
+    }
+
+    const unsigned long previous = ck->next;
+    while ((long)(c->cyc - ck->next) >= 0) {
+        ck->next += ck->interval;
+    }
+    schedule_checkpoint(ck, c, previous);
+
+    uint8_t record[RECORD_SIZE];
+    uint64_t hash = i8080_state_hash(c, ck->memory);
+
+    if (ck->recording) {
+        write64(&record[0], c->cyc);
+        write64(&record[8], hash);
+        fwrite(record, 1, sizeof(record), ck->file);
+    }
+    else if (fread(record, 1, sizeof(record), ck->file) != sizeof(record)) {
+        ck->ended = true;
+        return false;
+    }
+    else if ((unsigned long)read64(&record[0]) != c->cyc ||
+        read64(&record[8]) != hash) {
+        ck->diverged = true;
+        ck->divergence_cyc = c->cyc;
+        return false;
+    }
+
+    ck->index += 1;
+    return true;
+}
+
+void i8080_checkpoint_close(i8080_checkpoint* const ck) {
+    if (ck->file != NULL) {
+        fclose(ck->file);
+        ck->file = NULL;
+    }
+}
+
+// reads record `index` of a checkpoint file, returns false past its end
+static bool read_record(FILE* f, long long index, uint8_t* record) {
+    return fseek(f, (long)(HEADER_SIZE + index * RECORD_SIZE), SEEK_SET) == 0 &&
+        fread(record, 1, RECORD_SIZE, f) == RECORD_SIZE;
+}
+
+// finds the first checkpoint that differs between two checkpoint files with
+// a binary search (two runs that diverged never converge again). Returns its
+// index, -1 if the files match, -2 on error (including files recorded with
+// different intervals, whose records can't be compared).
+long long i8080_checkpoint_bisect(
+    const char* filename_a, const char* filename_b) {
+    FILE* a = i8080_open_file(filename_a, "rb");
+    FILE* b = i8080_open_file(filename_b, "rb");
+    long long result = -2;
+
+    unsigned long interval_a = a != NULL ? read_header(a) : 0;
+    unsigned long interval_b = b != NULL ? read_header(b) : 0;
+    if (a == NULL || b == NULL) {
+        fprintf(stderr, "error: can't open file '%s'.\n",
+            a == NULL ? filename_a : filename_b);
+    }
+    else if (interval_a == 0 || interval_b == 0) {
+        fprintf(stderr, "error: '%s' is not a checkpoint file.\n",
+            interval_a == 0 ? filename_a : filename_b);
+    }
+    else if (interval_a != interval_b) {
+        fprintf(stderr, "error: '%s' and '%s' have different intervals.\n",
+            filename_a, filename_b);
+    }
+    else {
+        fseek(a, 0, SEEK_END);
+        fseek(b, 0, SEEK_END);
+        long long nb_a = (ftell(a) - HEADER_SIZE) / RECORD_SIZE;
+        long long nb_b = (ftell(b) - HEADER_SIZE) / RECORD_SIZE;
+        long long lo = 0;
+        long long hi = nb_a < nb_b ? nb_a : nb_b;
+
+        // invariant: records before `lo` match, the record at `hi` (if any)
+        // differs
+        while (lo < hi) {
+            long long mid = lo + (hi - lo) / 2;
+            uint8_t ra[RECORD_SIZE], rb[RECORD_SIZE];
+            if (!read_record(a, mid, ra) || !read_record(b, mid, rb)) {
+                break;
+            }
+            if (memcmp(ra, rb, RECORD_SIZE) == 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+
+        result = lo == nb_a && nb_a == nb_b ? -1 : lo;
+    }
+
+    if (a != NULL) {
+        fclose(a);
+    }
+    if (b != NULL) {
+        fclose(b);
+    }
+    return result;
+}
+
+#undef HEADER_SIZE
+#undef RECORD_SIZE
@@ -0,0 +1,35 @@
+#ifndef I8080_CHECKPOINT_H_
+#define I8080_CHECKPOINT_H_
+
+#include "emu8080.h"
+
+// golden state-hash checkpoints: a recording run writes a hash of the whole
+// machine every `interval` cycles to a file, later runs compare their own
+// hashes against it and stop at the first divergence. The checkpoints lower
+// c->next_event to the next one; `interval` can't be 0.
+typedef struct i8080_checkpoint {
+	FILE* file;
+	bool recording; // false: comparing against the file
+	unsigned long interval; // cycles between two checkpoints
+	unsigned long next; // cycle of the next checkpoint
+	// optional view of the 64 KiB of memory, hashed directly instead of
+	// through read_byte
+	const uint8_t* memory;
+	uint64_t index; // checkpoints written or compared so far
+	bool ended; // the recording compared against is over
+	bool diverged;
+	unsigned long divergence_cyc; // cycle of the first differing checkpoint
+} i8080_checkpoint;
+
+uint64_t i8080_state_hash(i8080* const c, const uint8_t* memory);
+
+bool i8080_checkpoint_record(i8080_checkpoint* const ck, const char* filename,
+	unsigned long interval, i8080* const c);
+bool i8080_checkpoint_compare(i8080_checkpoint* const ck, const char* filename,
+	i8080* const c);
+bool i8080_checkpoint_tick(i8080_checkpoint* const ck, i8080* const c);
+void i8080_checkpoint_close(i8080_checkpoint* const ck);
+long long i8080_checkpoint_bisect(const char* filename_a,
+	const char* filename_b);
+
+#endif // I8080_CHECKPOINT_H_
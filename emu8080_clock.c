@@ -0,0 +1,80 @@
+// Host clock helpers, used to timestamp host events and pace the emulation.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#endif
+
+#include "emu8080_clock.h"
+
+// returns a monotonic host time in nanoseconds
+uint64_t i8080_clock_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// returns the cpu time consumed by the calling thread in nanoseconds
+uint64_t i8080_clock_cpu_ns(void) {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    uint64_t k = (uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+    uint64_t u = (uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+    return (k + u) * 100; // FILETIME counts 100ns intervals
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// waits until the host clock reaches `deadline_ns`: sleeps on a high
+// resolution timer, then spins for the last `spin_ns` (the sleep wake-up
+// is not precise enough on its own)
+// note: on windows, the timer is shared, only call it from one thread.
+void i8080_clock_sleep_until(uint64_t deadline_ns, uint64_t spin_ns) {
+    uint64_t now = i8080_clock_ns();
+
+    if (deadline_ns > now + spin_ns) {
+#ifdef _WIN32
+        uint64_t sleep_ns = deadline_ns - spin_ns - now;
+        static HANDLE timer = NULL;
+        if (timer == NULL) {
+            timer = CreateWaitableTimerExW(NULL, NULL,
+                CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        }
+        if (timer != NULL) {
+            LARGE_INTEGER due;
+            due.QuadPart = -(LONGLONG)(sleep_ns / 100); // relative, 100ns units
+            SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE);
+            WaitForSingleObject(timer, INFINITE);
+        }
+        else {
+            Sleep((DWORD)(sleep_ns / 1000000));
+        }
+#else
+        struct timespec ts;
+        ts.tv_sec = (deadline_ns - spin_ns) / 1000000000ULL;
+        ts.tv_nsec = (deadline_ns - spin_ns) % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#endif
+    }
+
+    while (i8080_clock_ns() < deadline_ns) {
+        // spin
+    }
+}
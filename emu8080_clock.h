@@ -0,0 +1,10 @@
+#ifndef I8080_CLOCK_H_
+#define I8080_CLOCK_H_
+
+#include <stdint.h>
+
+uint64_t i8080_clock_ns(void);
+uint64_t i8080_clock_cpu_ns(void);
+void i8080_clock_sleep_until(uint64_t deadline_ns, uint64_t spin_ns);
+
+#endif // I8080_CLOCK_H_
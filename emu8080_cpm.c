@@ -0,0 +1,684 @@
+// CP/M 2.2 BDOS emulation. The program is loaded at 0x0100 with the page zero
+// of a real system (JMP to the BIOS warm boot at 0x0000, JMP to the BDOS at
+// 0x0005, FCBs and command tail) and a BIOS jump table of RET stubs at
+// 0xFF00, and i8080_cpm_step catches the cpu when it reaches the BDOS or a
+// BIOS entry: the function is done by the host, then the cpu returns to the
+// caller as if a RET was executed.
+//
+// supported BDOS functions: 0-2, 6, 9-36 (search first/next only find file
+// names without wildcards, a search or a delete with wildcards ends the
+// program with an error). Supported BIOS entries: the boots (the program
+// ends), the console, LIST, PUNCH and READER (no devices); the disk entries
+// end the program with an error.
+//
+// note: memory is read directly, but the BDOS writes (records read, FCB
+// updates, console buffer) go through i8080_wb like the cpu's, so they are
+// seen by `dirty_pages` and a write log (credited to the CALL 5).
+
+#include <string.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <conio.h>
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+#include "emu8080_cpm.h"
+#include "emu8080_file.h"
+#include "emu8080_ops.h"
+
+#define RECORD_SIZE 128
+#define TPA_START 0x0100
+#define STACK_TOP 0xFE00
+#define BDOS_ENTRY 0xFE06
+#define BIOS_BASE 0xFF00
+#define BIOS_WBOOT (BIOS_BASE + 3)
+#define BIOS_ENTRIES 17 // BOOT to SECTRAN
+#define FCB1 0x005C
+#define FCB2 0x006C
+#define DEFAULT_DMA 0x0080
+#define FCB_SIZE 36
+
+// sets up page zero and the stack for a program loaded at 0x0100
+void i8080_cpm_init(i8080_cpm* const cpm, i8080* const c, uint8_t* memory) {
+    memset(cpm, 0, sizeof(*cpm));
+    cpm->memory = memory;
+    cpm->directory = "";
+    cpm->console = stdout;
+    cpm->input = stdin;
+    cpm->dma = DEFAULT_DMA;
+
+    memset(memory, 0, TPA_START);
+    memory[0x0000] = 0xC3; // JMP BIOS_WBOOT
+    memory[0x0001] = BIOS_WBOOT & 0xFF;
+    memory[0x0002] = BIOS_WBOOT >> 8;
+    memory[0x0005] = 0xC3; // JMP BDOS_ENTRY (programs read the top of the
+    memory[0x0006] = BDOS_ENTRY & 0xFF; // memory they can use at 0x0006)
+    memory[0x0007] = BDOS_ENTRY >> 8;
+    memset(&memory[FCB1 + 1], ' ', 11);
+    memset(&memory[FCB2 + 1], ' ', 11);
+
+    // BIOS jump table, each entry caught by i8080_cpm_step before its RET
+    memset(&memory[BIOS_BASE], 0, BIOS_ENTRIES * 3);
+    for (int i = 0; i < BIOS_ENTRIES; i++) {
+        memory[BIOS_BASE + i * 3] = 0xC9; // RET
+    }
+
+    // a RET from the program goes to the warm boot, like from the CCP
+    memory[STACK_TOP - 2] = 0x00;
+    memory[STACK_TOP - 1] = 0x00;
+    c->sp = STACK_TOP - 2;
+    c->pc = TPA_START;
+}
+
+// fills the 11 name bytes of a FCB from a file name like "foo.txt"
+static void parse_name(uint8_t* fcb, const char* name, size_t len) {
+    memset(&fcb[1], ' ', 11);
+    int field = 1; // 1: name, 9: type
+    int n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '.' && field == 1) {
+            field = 9;
+            n = 0;
+        }
+        else if (n < (field == 1 ? 8 : 3)) {
+            fcb[field + n++] = (uint8_t)toupper((unsigned char)name[i]);
+        }
+    }
+}
+
+// loads a .COM file at 0x0100, and sets up the command tail and the two
+// default FCBs from `args` (may be NULL)
+bool i8080_cpm_load(i8080_cpm* const cpm, const char* filename,
+    const char* args) {
+    FILE* f = i8080_open_file(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "error: can't open file '%s'.\n", filename);
+        return false;
+    }
+
+    size_t max_size = STACK_TOP - 2 - TPA_START;
+    size_t size = fread(&cpm->memory[TPA_START], 1, max_size, f);
+    bool too_big = size == max_size && fgetc(f) != EOF;
+    fclose(f);
+    if (too_big) {
+        fprintf(stderr, "error: file %s can't fit in memory.\n", filename);
+        return false;
+    }
+
+    // command tail: length, then the arguments in upper case with a leading
+    // space, like the CCP
+    uint8_t* tail = &cpm->memory[DEFAULT_DMA];
+    tail[0] = 0;
+    if (args != NULL && args[0] != '\0') {
+        size_t len = strlen(args);
+        if (len > 126) {
+            len = 126;
+        }
+        tail[0] = (uint8_t)(len + 1);
+        tail[1] = ' ';
+        for (size_t i = 0; i < len; i++) {
+            tail[2 + i] = (uint8_t)toupper((unsigned char)args[i]);
+        }
+    }
+
+    // the first two words are also parsed into the default FCBs
+    const char* p = args != NULL ? args : "";
+    for (int i = 0; i < 2; i++) {
+        while (*p == ' ') {
+            p++;
+        }
+        const char* word = p;
+        while (*p != '\0' && *p != ' ') {
+            p++;
+        }
+        if (p > word) {
+            parse_name(&cpm->memory[i == 0 ? FCB1 : FCB2], word,
+                (size_t)(p - word));
+        }
+    }
+    return true;
+}
+
+// console
+
+void i8080_cpm_flush(i8080_cpm* const cpm) {
+    if (cpm->console_len > 0) {
+        fwrite(cpm->console_buffer, 1, cpm->console_len, cpm->console);
+        cpm->console_len = 0;
+    }
+    fflush(cpm->console);
+}
+
+static inline void console_out(i8080_cpm* const cpm, uint8_t ch) {
+    if (cpm->console_len == I8080_CPM_CONSOLE_BUFFER) {
+        fwrite(cpm->console_buffer, 1, cpm->console_len, cpm->console);
+        cpm->console_len = 0;
+    }
+    cpm->console_buffer[cpm->console_len++] = (char)ch;
+}
+
+static uint8_t console_in(i8080_cpm* const cpm) {
+    i8080_cpm_flush(cpm);
+    int ch = getc(cpm->input);
+    if (ch == EOF) {
+        return 0x1A; // ^Z
+    }
+    return ch == '\n' ? '\r' : (uint8_t)ch;
+}
+
+// returns true if a character can be read without waiting: always from a
+// file or a pipe (^Z at its end), from a terminal once a key was pressed (a
+// line typed, in line mode)
+static bool console_ready(i8080_cpm* const cpm) {
+#ifdef _WIN32
+    int fd = _fileno(cpm->input);
+    return !_isatty(fd) || (fd == 0 && _kbhit());
+#else
+    struct pollfd p = { .fd = fileno(cpm->input), .events = POLLIN };
+    return !isatty(p.fd) || poll(&p, 1, 0) > 0;
+#endif
+}
+
+// echoes a character read by the BDOS (printable ones and CR, LF, BS, TAB,
+// like CP/M)
+static void console_echo(i8080_cpm* const cpm, uint8_t ch) {
+    if (ch >= ' ' || ch == '\r' || ch == '\n' || ch == '\b' || ch == '\t') {
+        console_out(cpm, ch);
+    }
+}
+
+// copies between the cpu memory and host buffers (wrapping around at 64 KiB),
+// the writes through the cpu
+static void copy_from_memory(const i8080_cpm* const cpm, uint8_t* dst,
+    uint16_t addr, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = cpm->memory[(uint16_t)(addr + i)];
+    }
+}
+
+static void copy_to_memory(i8080* const c, uint16_t addr, const uint8_t* src,
+    size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        i8080_wb(c, (uint16_t)(addr + i), src[i]);
+    }
+}
+
+// files
+
+// returns true if the file name of a FCB has wildcards
+static bool has_wildcards(const uint8_t* fcb) {
+    for (int i = 1; i < 12; i++) {
+        if ((fcb[i] & 0x7F) == '?') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// builds the host path of the file named in a FCB. Returns false if the
+// name has wildcards.
+static bool host_path(const i8080_cpm* const cpm, const uint8_t* fcb,
+    char* path, size_t path_size) {
+    char name[13];
+    int n = 0;
+    if (has_wildcards(fcb)) {
+        return false;
+    }
+    for (int i = 1; i < 12; i++) {
+        char ch = (char)(fcb[i] & 0x7F); // without the attribute bits
+        if (i == 9 && (fcb[9] & 0x7F) != ' ') {
+            name[n++] = '.';
+        }
+        if (ch != ' ') {
+            name[n++] = (char)tolower((unsigned char)ch);
+        }
+    }
+    name[n] = '\0';
+    snprintf(path, path_size, "%s%s", cpm->directory, name);
+    return n > 0;
+}
+
+static i8080_cpm_file* find_file(i8080_cpm* const cpm, uint16_t fcb) {
+    for (int i = 0; i < I8080_CPM_MAX_FILES; i++) {
+        if (cpm->files[i].f != NULL && cpm->files[i].fcb == fcb) {
+            return &cpm->files[i];
+        }
+    }
+    return NULL;
+}
+
+static void close_file(i8080_cpm_file* const file) {
+    fclose(file->f);
+    file->f = NULL;
+}
+
+// opens the file named in `fcb`, a FCB at `addr` (programs often never close
+// the files they read, so a FCB opened again replaces its previous file)
+static uint8_t open_fcb(i8080_cpm* const cpm, uint8_t* fcb, uint16_t addr,
+    bool create) {
+    char path[512];
+    if (!host_path(cpm, fcb, path, sizeof(path))) {
+        return 0xFF;
+    }
+
+    i8080_cpm_file* file = find_file(cpm, addr);
+    if (file != NULL) {
+        close_file(file);
+    }
+    for (int i = 0; i < I8080_CPM_MAX_FILES && file == NULL; i++) {
+        if (cpm->files[i].f == NULL) {
+            file = &cpm->files[i];
+        }
+    }
+    if (file == NULL) {
+        return 0xFF;
+    }
+
+    if (create) {
+        file->f = i8080_open_file(path, "w+b");
+    }
+    else {
+        file->f = i8080_open_file(path, "r+b");
+        if (file->f == NULL) {
+            file->f = i8080_open_file(path, "rb"); // read-only file
+        }
+    }
+    if (file->f == NULL) {
+        return 0xFF;
+    }
+    file->fcb = addr;
+    file->pos = -1;
+    file->writing = false;
+
+    // records in the opened extent
+    fseek(file->f, 0, SEEK_END);
+    long records = (ftell(file->f) + RECORD_SIZE - 1) / RECORD_SIZE;
+    long extent_start = (fcb[12] & 0x1F) * 128L;
+    records -= extent_start;
+    fcb[15] = (uint8_t)(records < 0 ? 0 : records > 128 ? 128 : records);
+    fcb[14] = 0; // s2
+    return 0;
+}
+
+// record number of the sequential position of a FCB (extent, module and
+// current record fields)
+static long sequential_record(const uint8_t* fcb) {
+    return (((fcb[14] & 0x3F) * 32L) + (fcb[12] & 0x1F)) * 128 + fcb[32];
+}
+
+static void set_sequential_record(uint8_t* fcb, long record) {
+    fcb[32] = record & 0x7F;
+    fcb[12] = (record >> 7) & 0x1F;
+    fcb[14] = (record >> 12) & 0x3F;
+}
+
+static long random_record(const uint8_t* fcb) {
+    return fcb[33] | fcb[34] << 8 | (fcb[35] & 0x03) << 16;
+}
+
+// moves a file to a record, for a read or a write (stdio needs a seek
+// between the two)
+static bool seek_record(i8080_cpm_file* const file, long record, bool write) {
+    long pos = record * RECORD_SIZE;
+    if (file->pos != pos || file->writing != write) {
+        if (fseek(file->f, pos, SEEK_SET) != 0) {
+            file->pos = -1;
+            return false;
+        }
+    }
+    file->pos = pos;
+    file->writing = write;
+    return true;
+}
+
+// reads a record into the DMA buffer: 0 if done, 1 past the end of file
+static uint8_t read_record(i8080_cpm* const cpm, i8080* const c,
+    i8080_cpm_file* const file, long record) {
+    uint8_t buf[RECORD_SIZE];
+    if (!seek_record(file, record, false)) {
+        return 1;
+    }
+    size_t n = fread(buf, 1, RECORD_SIZE, file->f);
+    file->pos += (long)n;
+    if (n == 0) {
+        return 1;
+    }
+    memset(&buf[n], 0x1A, RECORD_SIZE - n); // last record padded with ^Z
+    copy_to_memory(c, cpm->dma, buf, RECORD_SIZE);
+    return 0;
+}
+
+// writes the DMA buffer to a record: 0 if done, 2 if the disk is full
+static uint8_t write_record(i8080_cpm* const cpm, i8080_cpm_file* const file,
+    long record) {
+    uint8_t buf[RECORD_SIZE];
+    copy_from_memory(cpm, buf, cpm->dma, RECORD_SIZE);
+    if (!seek_record(file, record, true)) {
+        return 2;
+    }
+    size_t n = fwrite(buf, 1, RECORD_SIZE, file->f);
+    file->pos += (long)n;
+    return n == RECORD_SIZE ? 0 : 2;
+}
+
+// BDOS
+
+// return address of a BDOS or BIOS call
+static uint16_t caller(const i8080_cpm* const cpm, const i8080* const c) {
+    return cpm->memory[c->sp] | cpm->memory[(uint16_t)(c->sp + 1)] << 8;
+}
+
+// ends the program on a search or a delete with wildcards, which would need
+// a directory listing
+static void unsupported_wildcards(i8080_cpm* const cpm, i8080* const c) {
+    i8080_cpm_flush(cpm);
+    fprintf(stderr, "error: BDOS %d with wildcards called from %04X is not "
+        "supported.\n", c->c, caller(cpm, c));
+    cpm->finished = true;
+}
+
+static void return_byte(i8080* const c, uint8_t val) {
+    c->a = c->l = val;
+    c->b = c->h = 0;
+}
+
+static void return_word(i8080* const c, uint16_t val) {
+    c->l = val & 0xFF;
+    c->h = val >> 8;
+    c->a = c->l;
+    c->b = c->h;
+}
+
+static void bdos(i8080_cpm* const cpm, i8080* const c) {
+    uint16_t de = c->d << 8 | c->e;
+    uint8_t fcb[FCB_SIZE]; // copy of the FCB at DE, for the file functions
+    bool uses_fcb = (c->c >= 15 && c->c <= 23) || (c->c >= 33 && c->c <= 36);
+    i8080_cpm_file* file;
+    char path[512], new_path[512];
+    uint8_t result = 0;
+
+    if (uses_fcb) {
+        copy_from_memory(cpm, fcb, de, FCB_SIZE);
+    }
+
+    switch (c->c) {
+    case 0: // system reset
+        cpm->finished = true;
+        break;
+    case 1: // console input, with echo
+        result = console_in(cpm);
+        console_echo(cpm, result);
+        break;
+    case 2: // console output
+        console_out(cpm, c->e);
+        break;
+    case 6: // direct console io: input (0 if none ready), status or output
+        if (c->e == 0xFF) {
+            result = console_ready(cpm) ? console_in(cpm) : 0x00;
+        }
+        else if (c->e == 0xFE) {
+            result = console_ready(cpm) ? 0xFF : 0x00;
+        }
+        else {
+            console_out(cpm, c->e);
+        }
+        break;
+    case 9: // print string, up to '$'
+        for (uint16_t addr = de, n = 0; cpm->memory[addr] != '$' &&
+            n < 0xFFFF; addr++, n++) {
+            console_out(cpm, cpm->memory[addr]);
+        }
+        break;
+    case 10: { // read console buffer, with echo, ended by a CR
+        uint8_t max = cpm->memory[de];
+        uint8_t n = 0;
+        i8080_cpm_flush(cpm);
+        int ch;
+        while (n < max && (ch = getc(cpm->input)) != EOF && ch != '\n') {
+            i8080_wb(c, (uint16_t)(de + 2 + n++), (uint8_t)ch);
+            console_echo(cpm, (uint8_t)ch);
+        }
+        i8080_wb(c, (uint16_t)(de + 1), n);
+        console_out(cpm, '\r');
+        break;
+    }
+    case 11: // console status
+        result = console_ready(cpm) ? 0xFF : 0x00;
+        break;
+    case 12: // version: CP/M 2.2
+        return_word(c, 0x0022);
+        return;
+    case 13: // reset disk system
+        cpm->dma = DEFAULT_DMA;
+        cpm->drive = 0;
+        break;
+    case 14: // select disk
+        cpm->drive = c->e;
+        break;
+    case 15: // open file
+        result = open_fcb(cpm, fcb, de, false);
+        break;
+    case 16: // close file
+        file = find_file(cpm, de);
+        if (file != NULL) {
+            close_file(file);
+        }
+        result = file != NULL ? 0 : 0xFF;
+        break;
+    case 17: // search first
+        result = 0xFF;
+        if (fcb[0] == '?' || has_wildcards(fcb)) {
+            unsupported_wildcards(cpm, c);
+        }
+        else if (host_path(cpm, fcb, path, sizeof(path))) {
+            FILE* f = i8080_open_file(path, "rb");
+            if (f != NULL) {
+                fclose(f);
+                uint8_t entry[32] = { 0 }; // directory entry, user 0
+                memcpy(&entry[1], &fcb[1], 11);
+                copy_to_memory(c, cpm->dma, entry, sizeof(entry));
+                result = 0;
+            }
+        }
+        break;
+    case 18: // search next
+        result = 0xFF;
+        break;
+    case 19: // delete file
+        if (has_wildcards(fcb)) {
+            unsupported_wildcards(cpm, c);
+            break;
+        }
+        result = host_path(cpm, fcb, path, sizeof(path)) &&
+            remove(path) == 0 ? 0 : 0xFF;
+        break;
+    case 20: // read sequential
+        file = find_file(cpm, de);
+        if (file == NULL) {
+            result = 9; // invalid FCB
+            break;
+        }
+        result = read_record(cpm, c, file, sequential_record(fcb));
+        if (result == 0) {
+            set_sequential_record(fcb, sequential_record(fcb) + 1);
+        }
+        break;
+    case 21: // write sequential
+        file = find_file(cpm, de);
+        if (file == NULL) {
+            result = 9;
+            break;
+        }
+        result = write_record(cpm, file, sequential_record(fcb));
+        if (result == 0) {
+            set_sequential_record(fcb, sequential_record(fcb) + 1);
+        }
+        break;
+    case 22: // make file
+        result = open_fcb(cpm, fcb, de, true);
+        break;
+    case 23: // rename file (new name in the second half of the FCB)
+        result = host_path(cpm, fcb, path, sizeof(path)) &&
+            host_path(cpm, &fcb[16], new_path, sizeof(new_path)) &&
+            rename(path, new_path) == 0 ? 0 : 0xFF;
+        break;
+    case 24: // login vector: only drive A
+        return_word(c, 0x0001);
+        return;
+    case 25: // current disk
+        result = cpm->drive;
+        break;
+    case 26: // set DMA address
+        cpm->dma = de;
+        break;
+    case 32: // get/set user code (always user 0)
+        break;
+    case 33: // read random
+    case 34: // write random
+        file = find_file(cpm, de);
+        if (file == NULL) {
+            result = 9;
+            break;
+        }
+        // the sequential position is moved to the record
+        set_sequential_record(fcb, random_record(fcb));
+        result = c->c == 33 ? read_record(cpm, c, file, random_record(fcb)) :
+            write_record(cpm, file, random_record(fcb));
+        break;
+    case 35: { // compute file size
+        result = 0xFF;
+        if (host_path(cpm, fcb, path, sizeof(path))) {
+            FILE* f = i8080_open_file(path, "rb");
+            if (f != NULL) {
+                fseek(f, 0, SEEK_END);
+                long records = (ftell(f) + RECORD_SIZE - 1) / RECORD_SIZE;
+                fclose(f);
+                fcb[33] = records & 0xFF;
+                fcb[34] = (records >> 8) & 0xFF;
+                fcb[35] = (records >> 16) & 0x03;
+                result = 0;
+            }
+        }
+        break;
+    }
+    case 36: { // set random record
+        long record = sequential_record(fcb);
+        fcb[33] = record & 0xFF;
+        fcb[34] = (record >> 8) & 0xFF;
+        fcb[35] = (record >> 16) & 0x03;
+        break;
+    }
+    default: // not supported (disk allocation, BIOS parameters...)
+        result = 0xFF;
+        break;
+    }
+
+    if (uses_fcb && !cpm->finished) {
+        copy_to_memory(c, de, fcb, FCB_SIZE);
+    }
+    return_byte(c, result);
+}
+
+// BIOS
+
+static const char* BIOS_NAMES[BIOS_ENTRIES] = { "BOOT", "WBOOT", "CONST",
+    "CONIN", "CONOUT", "LIST", "PUNCH", "READER", "HOME", "SELDSK", "SETTRK",
+    "SETSEC", "SETDMA", "READ", "WRITE", "LISTST", "SECTRAN" };
+
+// does the BIOS entry `entry`, the disk ones (HOME to SECTRAN, but LISTST)
+// end the program
+static void bios(i8080_cpm* const cpm, i8080* const c, int entry) {
+    switch (entry) {
+    case 0: // BOOT
+    case 1: // WBOOT
+        cpm->finished = true;
+        break;
+    case 2: // CONST
+        c->a = console_ready(cpm) ? 0xFF : 0x00;
+        break;
+    case 3: // CONIN (no echo)
+        c->a = console_in(cpm);
+        break;
+    case 4: // CONOUT
+        console_out(cpm, c->c);
+        break;
+    case 5: // LIST, no printer: dropped
+    case 6: // PUNCH, no punch: dropped
+        break;
+    case 7: // READER, no reader: end of file
+        c->a = 0x1A;
+        break;
+    case 15: // LISTST: always ready
+        c->a = 0xFF;
+        break;
+    default:
+        i8080_cpm_flush(cpm);
+        fprintf(stderr, "error: BIOS %s (%04X) called from %04X is not "
+            "supported.\n", BIOS_NAMES[entry], c->pc, caller(cpm, c));
+        cpm->finished = true;
+        break;
+    }
+}
+
+// steps the cpu, or does the BDOS call / BIOS entry it just reached. Returns
+// false once the program has ended.
+bool i8080_cpm_step(i8080_cpm* const cpm, i8080* const c) {
+    if (cpm->finished) {
+        return false;
+    }
+
+    int bios_offset = c->pc - BIOS_BASE;
+    if (c->pc == 0x0005 || c->pc == BDOS_ENTRY ||
+        (bios_offset >= 0 && bios_offset < BIOS_ENTRIES * 3 &&
+        bios_offset % 3 == 0)) {
+        if (c->pc == 0x0005 || c->pc == BDOS_ENTRY) {
+            bdos(cpm, c);
+        }
+        else {
+            bios(cpm, c, bios_offset / 3);
+        }
+        c->cyc += cpm->bdos_cycles;
+
+        // RET (the cpu is left at the entry that ended the program)
+        if (!cpm->finished) {
+            c->pc = caller(cpm, c);
+            c->sp += 2;
+        }
+    }
+    else if (c->pc == 0x0000) {
+        cpm->finished = true;
+    }
+    else {
+        i8080_step(c);
+    }
+
+    if (cpm->finished) {
+        i8080_cpm_flush(cpm);
+        return false;
+    }
+    return true;
+}
+
+// flushes the console and closes the files left open
+void i8080_cpm_close(i8080_cpm* const cpm) {
+    i8080_cpm_flush(cpm);
+    for (int i = 0; i < I8080_CPM_MAX_FILES; i++) {
+        if (cpm->files[i].f != NULL) {
+            close_file(&cpm->files[i]);
+        }
+    }
+}
+
+#undef RECORD_SIZE
+#undef TPA_START
+#undef STACK_TOP
+#undef BDOS_ENTRY
+#undef BIOS_BASE
+#undef BIOS_WBOOT
+#undef BIOS_ENTRIES
+#undef FCB1
+#undef FCB2
+#undef DEFAULT_DMA
+#undef FCB_SIZE
@@ -0,0 +1,44 @@
+#ifndef I8080_CPM_H_
+#define I8080_CPM_H_
+
+#include "emu8080.h"
+
+#define I8080_CPM_MAX_FILES 16
+#define I8080_CPM_CONSOLE_BUFFER 4096
+
+// a host file opened by a CP/M program, identified by the address of its FCB
+typedef struct i8080_cpm_file {
+	FILE* f; // NULL: free
+	uint16_t fcb;
+	long pos; // position of `f`, -1 if it has to be set before the next access
+	bool writing; // last access was a write
+} i8080_cpm_file;
+
+// CP/M 2.2 emulation: runs .COM programs with the BDOS calls (CALL 5) and the
+// BIOS entries (jump table at 0xFF00) done by the host. The console goes
+// through a buffer, and files are host files (in `directory`, with lower case
+// names) read and written through stdio.
+typedef struct i8080_cpm {
+	uint8_t* memory; // the 64 KiB the cpu runs in, read directly
+	const char* directory; // prefix of the host file names (default: "")
+	FILE* console; // console output (default: stdout)
+	FILE* input; // console input (default: stdin)
+	unsigned long bdos_cycles; // cycles charged per BDOS/BIOS call (default: 0)
+	bool finished; // set by a warm boot or a system reset
+
+	uint16_t dma; // address of the 128-byte record buffer
+	uint8_t drive; // current drive (only reported, there is one directory)
+	i8080_cpm_file files[I8080_CPM_MAX_FILES];
+
+	size_t console_len;
+	char console_buffer[I8080_CPM_CONSOLE_BUFFER];
+} i8080_cpm;
+
+void i8080_cpm_init(i8080_cpm* const cpm, i8080* const c, uint8_t* memory);
+bool i8080_cpm_load(i8080_cpm* const cpm, const char* filename,
+	const char* args);
+bool i8080_cpm_step(i8080_cpm* const cpm, i8080* const c);
+void i8080_cpm_flush(i8080_cpm* const cpm);
+void i8080_cpm_close(i8080_cpm* const cpm);
+
+#endif // I8080_CPM_H_
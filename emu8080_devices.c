@@ -0,0 +1,165 @@
+// Cycle-driven device scheduler: devices waiting for cycles sit in a min-heap
+// ordered on their wake-up cycle, and the cpu runs uninterrupted until the
+// first one is due. Devices waiting for a port write are resumed from the
+// OUT instruction itself, through a handler hooked in the port table.
+// Nothing is allocated: devices are owned by the user, the heap is fixed.
+
+#include <string.h>
+#include "emu8080_devices.h"
+
+static bool wakes_before(const i8080_device* a, const i8080_device* b) {
+    return (long)(a->wake_cyc - b->wake_cyc) < 0;
+}
+
+static void heap_push(i8080_scheduler* const s, i8080_device* const d) {
+    int i = s->nb_timed++;
+    while (i > 0 && wakes_before(d, s->timed[(i - 1) / 2])) {
+        s->timed[i] = s->timed[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->timed[i] = d;
+}
+
+static i8080_device* heap_pop(i8080_scheduler* const s) {
+    i8080_device* const top = s->timed[0];
+    i8080_device* const last = s->timed[--s->nb_timed];
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= s->nb_timed) {
+            break;
+        }
+        if (child + 1 < s->nb_timed &&
+            wakes_before(s->timed[child + 1], s->timed[child])) {
+            child++;
+        }
+        if (!wakes_before(s->timed[child], last)) {
+            break;
+        }
+        s->timed[i] = s->timed[child];
+        i = child;
+    }
+    s->timed[i] = last;
+    return top;
+}
+
+static void port_write(void* userdata, uint8_t port, uint8_t value);
+
+// resumes a device, then files it according to what it waits for
+static void resume(i8080_scheduler* const s, i8080_device* const d) {
+    d->run(d, s->cpu);
+
+    switch (d->wait) {
+    case I8080_DEVICE_WAITING_CYCLES:
+        heap_push(s, d);
+        // a device resumed by a port write can wake up before the cpu stops
+        if (s->running && (long)(d->wake_cyc - s->cpu->next_event) < 0) {
+            s->cpu->next_event = d->wake_cyc;
+        }
+        break;
+    case I8080_DEVICE_WAITING_PORT:
+        if (!s->hooked[d->wait_port]) {
+            s->previous[d->wait_port] = s->ports[d->wait_port];
+            s->ports[d->wait_port].out = port_write;
+            s->ports[d->wait_port].out_userdata = s;
+            s->hooked[d->wait_port] = true;
+        }
+        d->next_waiter = s->port_waiters[d->wait_port];
+        s->port_waiters[d->wait_port] = d;
+        break;
+    default:
+        break;
+    }
+}
+
+// port handler: forwards the write to the previous handler (or port_out),
+// then resumes the devices waiting for it
+static void port_write(void* userdata, uint8_t port, uint8_t value) {
+    i8080_scheduler* const s = userdata;
+    const i8080_port* const previous = &s->previous[port];
+
+    if (previous->out != NULL) {
+        previous->out(previous->out_userdata, port, value);
+    }
+    else if (s->cpu->port_out != NULL) {
+        s->cpu->port_out(s->cpu->userdata, port, value);
+    }
+
+    i8080_device* d = s->port_waiters[port];
+    s->port_waiters[port] = NULL;
+    while (d != NULL) {
+        i8080_device* const next = d->next_waiter;
+        d->port_value = value;
+        d->now = s->cpu->cyc;
+        resume(s, d);
+        d = next;
+    }
+}
+
+// initialises a scheduler; `ports` must be the port table of the cpu
+// (c->ports), the scheduler hooks the ports its devices wait on
+void i8080_scheduler_init(i8080_scheduler* const s, i8080_port* ports) {
+    memset(s, 0, sizeof(*s));
+    s->ports = ports;
+}
+
+// adds a device and runs it until its first wait
+bool i8080_scheduler_add(
+    i8080_scheduler* const s, i8080_device* const d, i8080* const c) {
+    if (s->nb_devices >= I8080_MAX_DEVICES) {
+        return false;
+    }
+    s->nb_devices += 1;
+    s->cpu = c;
+
+    d->resume = 0;
+    d->wait = I8080_DEVICE_READY;
+    d->now = c->cyc;
+    d->next_waiter = NULL;
+    resume(s, d);
+    return true;
+}
+
+// runs the cpu until `until` cycles, resuming the devices at their wake-up
+// cycles (a device is resumed after the instruction that reaches its cycle).
+// c->next_event is the next stop while it runs (an event the user scheduled
+// before `until` being one), and is restored when it returns.
+void i8080_scheduler_run(
+    i8080_scheduler* const s, i8080* const c, unsigned long until) {
+    const unsigned long next_event = c->next_event;
+    s->cpu = c;
+    s->running = true;
+
+    while ((long)(until - c->cyc) > 0) {
+        c->next_event = until;
+        if (s->nb_timed > 0 && (long)(s->timed[0]->wake_cyc - until) < 0) {
+            c->next_event = s->timed[0]->wake_cyc;
+        }
+        if (next_event != 0 && (long)(next_event - c->cyc) > 0 &&
+            (long)(next_event - c->next_event) < 0) {
+            c->next_event = next_event;
+        }
+
+        // next_event is lowered by resume() if an OUT wakes up a device that
+        // then waits for fewer cycles
+        while ((long)(c->next_event - c->cyc) > 0) {
+            if (c->halted &&
+                !(c->interrupt_pending && c->iff && c->interrupt_delay == 0)) {
+                c->cyc = c->next_event; // nothing to do until a device wakes up
+                break;
+            }
+            i8080_step(c);
+        }
+
+        while (s->nb_timed > 0 &&
+            (long)(s->timed[0]->wake_cyc - c->cyc) <= 0) {
+            i8080_device* const d = heap_pop(s);
+            d->now = d->wake_cyc;
+            resume(s, d);
+        }
+    }
+
+    s->running = false;
+    c->next_event = next_event;
+}
@@ -0,0 +1,89 @@
+#ifndef I8080_DEVICES_H_
+#define I8080_DEVICES_H_
+
+#include "emu8080.h"
+
+#define I8080_MAX_DEVICES 32
+
+// Peripherals written as coroutines driven by the cycle clock. A device body
+// is a function that is re-entered where it last waited; it can wait for a
+// number of cycles or for a write on a port. The bodies are stackless: their
+// local variables do not survive a wait, keep the state in the device, and
+// there can be only one wait per source line.
+//
+//   static void vblank(i8080_device* d, i8080* c) {
+//       I8080_DEVICE_BEGIN(d);
+//       for (;;) {
+//           I8080_DEVICE_WAIT_CYCLES(d, 16667);
+//           i8080_interrupt(c, 0xCF); // RST 1, mid-screen
+//           I8080_DEVICE_WAIT_CYCLES(d, 16666);
+//           i8080_interrupt(c, 0xD7); // RST 2, vblank
+//       }
+//       I8080_DEVICE_END(d);
+//   }
+
+typedef enum i8080_device_wait {
+	I8080_DEVICE_READY, // not started yet
+	I8080_DEVICE_WAITING_CYCLES, // waiting until `wake_cyc`
+	I8080_DEVICE_WAITING_PORT, // waiting for a write on `wait_port`
+	I8080_DEVICE_DONE,
+} i8080_device_wait;
+
+typedef struct i8080_device {
+	void (*run)(struct i8080_device*, i8080*); // coroutine body
+	void* userdata;
+
+	int resume; // where the body resumes (0: from the start)
+	i8080_device_wait wait;
+	unsigned long now; // cycle the device was resumed at
+	unsigned long wake_cyc;
+	uint8_t wait_port;
+	uint8_t port_value; // value written on the port waited for
+	struct i8080_device* next_waiter; // next device waiting on the same port
+} i8080_device;
+
+typedef struct i8080_scheduler {
+	i8080_device* timed[I8080_MAX_DEVICES]; // min-heap on wake_cyc
+	int nb_timed;
+	int nb_devices;
+	i8080_device* port_waiters[256]; // lists of devices waiting for a write
+	i8080* cpu;
+	i8080_port* ports; // port table the scheduler hooks its writes into
+	i8080_port previous[256]; // handlers replaced in `ports`
+	bool hooked[256];
+	bool running; // in i8080_scheduler_run (c->next_event is the next wake-up)
+} i8080_scheduler;
+
+#define I8080_DEVICE_BEGIN(d) \
+  switch ((d)->resume) { \
+  case 0:
+
+#define I8080_DEVICE_WAIT_CYCLES(d, n) \
+  do { \
+    (d)->wake_cyc = (d)->now + (n); \
+    (d)->wait = I8080_DEVICE_WAITING_CYCLES; \
+    (d)->resume = __LINE__; \
+    return; \
+  case __LINE__:; \
+  } while (0)
+
+#define I8080_DEVICE_WAIT_PORT(d, port) \
+  do { \
+    (d)->wait_port = (port); \
+    (d)->wait = I8080_DEVICE_WAITING_PORT; \
+    (d)->resume = __LINE__; \
+    return; \
+  case __LINE__:; \
+  } while (0)
+
+#define I8080_DEVICE_END(d) \
+  } \
+  (d)->wait = I8080_DEVICE_DONE
+
+void i8080_scheduler_init(i8080_scheduler* const s, i8080_port* ports);
+bool i8080_scheduler_add(i8080_scheduler* const s, i8080_device* const d,
+	i8080* const c);
+void i8080_scheduler_run(i8080_scheduler* const s, i8080* const c,
+	unsigned long until);
+
+#endif // I8080_DEVICES_H_
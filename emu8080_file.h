@@ -0,0 +1,19 @@
+#ifndef I8080_FILE_H_
+#define I8080_FILE_H_
+
+// Opening files portably, for the modules and tools that read or write them.
+
+#include <stdio.h>
+
+// fopen, without the msvc deprecation error (fopen_s there). Returns NULL if
+// the file can't be opened.
+static inline FILE* i8080_open_file(const char* filename, const char* mode) {
+#ifdef _MSC_VER
+    FILE* f;
+    return fopen_s(&f, filename, mode) == 0 ? f : NULL;
+#else
+    return fopen(filename, mode);
+#endif
+}
+
+#endif // I8080_FILE_H_
@@ -0,0 +1,242 @@
+// High-level emulation hooks. i8080_step calls i8080_hooks_call before
+// fetching an instruction at a hooked address (looked up in a bitmap, so the
+// cost for the other addresses is a bit test).
+//
+// validation runs the routine twice from the same state, interpreted then
+// native, and compares the registers, flags, memory and cycles: the port
+// accesses of the routine are done twice, and memory is snapshot through
+// `read_byte` (64K calls), so it is meant for testing, not for normal runs.
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080_hooks.h"
+#include "emu8080_ops.h"
+
+#define MEMORY_SIZE 0x10000
+
+// initialises an empty set of hooks
+void i8080_hooks_init(i8080_hooks* const hooks) {
+    memset(hooks, 0, sizeof(*hooks));
+    hooks->max_cycles = 10000000;
+    hooks->report = stderr;
+}
+
+void i8080_hooks_free(i8080_hooks* const hooks) {
+    free(hooks->before);
+    free(hooks->after);
+    hooks->before = NULL;
+    hooks->after = NULL;
+}
+
+// hooks a routine (replacing the previous hook at `addr` if any). Returns
+// NULL if there are already I8080_MAX_HOOKS hooks.
+i8080_hook* i8080_hooks_add(i8080_hooks* const hooks, uint16_t addr,
+    unsigned long (*run)(i8080*, void*), void* userdata, unsigned flags) {
+    i8080_hook* h = i8080_hooks_find(hooks, addr);
+    if (h == NULL) {
+        if (hooks->count == I8080_MAX_HOOKS) {
+            return NULL;
+        }
+        h = &hooks->hooks[hooks->count++];
+    }
+
+    memset(h, 0, sizeof(*h));
+    h->addr = addr;
+    h->run = run;
+    h->userdata = userdata;
+    h->flags = flags;
+    hooks->addresses[addr >> 5] |= 1u << (addr & 31);
+    return h;
+}
+
+i8080_hook* i8080_hooks_find(i8080_hooks* const hooks, uint16_t addr) {
+    if (!(hooks->addresses[addr >> 5] & (1u << (addr & 31)))) {
+        return NULL;
+    }
+    for (int i = 0; i < hooks->count; i++) {
+        if (hooks->hooks[i].addr == addr) {
+            return &hooks->hooks[i];
+        }
+    }
+    return NULL;
+}
+
+// the registers and flags a routine starts with, packed in 64 bits
+static uint64_t routine_inputs(const i8080* const c) {
+    uint8_t flags = c->sf << 7 | c->zf << 6 | c->hf << 4 | c->pf << 2 | c->cf;
+    return (uint64_t)c->a | (uint64_t)c->b << 8 | (uint64_t)c->c << 16 |
+        (uint64_t)c->d << 24 | (uint64_t)c->e << 32 | (uint64_t)c->h << 40 |
+        (uint64_t)c->l << 48 | (uint64_t)flags << 56;
+}
+
+// slot of the cost measured for `inputs` in `measured_cycles`
+static int measured_slot(uint64_t inputs) {
+    return (int)(((inputs * 0x9E3779B97F4A7C15ULL) >> 32) %
+        I8080_HOOK_MEASURED);
+}
+
+// returns the cost measured for `inputs`, 0 if there is none
+static unsigned long measured(const i8080_hook* const h, uint64_t inputs) {
+    int slot = measured_slot(inputs);
+    return h->measured_inputs[slot] == inputs ? h->measured_cycles[slot] : 0;
+}
+
+// runs the native handler, then returns to the caller
+static void call_native(i8080_hook* const h, i8080* const c) {
+    const unsigned long measured_cycles = measured(h, routine_inputs(c));
+    unsigned long cycles = h->run(c, h->userdata);
+    if ((h->flags & I8080_HOOK_MEASURE) && measured_cycles != 0) {
+        cycles = measured_cycles;
+    }
+
+    c->pc = i8080_pop_stack(c);
+    c->cyc += cycles;
+    c->interrupt_delay = 0; // a routine is more than one instruction
+}
+
+static bool same_registers(const i8080* const a, const i8080* const b) {
+    return a->pc == b->pc && a->sp == b->sp && a->a == b->a && a->b == b->b &&
+        a->c == b->c && a->d == b->d && a->e == b->e && a->h == b->h &&
+        a->l == b->l && a->sf == b->sf && a->zf == b->zf && a->hf == b->hf &&
+        a->pf == b->pf && a->cf == b->cf && a->iff == b->iff &&
+        a->halted == b->halted;
+}
+
+// writes back the bytes of `memory` that differ from the cpu memory (the
+// pages are marked dirty, not logged)
+static void restore_memory(i8080* const c, const uint8_t* memory,
+    const uint8_t* current) {
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (current[i] != memory[i]) {
+            MARK_DIRTY(c, i);
+            c->write_byte(c->userdata, (uint16_t)i, memory[i]);
+        }
+    }
+}
+
+static void snapshot_memory(i8080* const c, uint8_t* memory) {
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        memory[i] = c->read_byte(c->userdata, (uint16_t)i);
+    }
+}
+
+// runs the routine interpreted until it returns, then native from the same
+// state, and keeps the interpreted result if they differ
+static void call_validated(
+    i8080_hooks* const hooks, i8080_hook* const h, i8080* const c) {
+    const i8080 start = *c;
+    snapshot_memory(c, hooks->before);
+    uint16_t ret_sp = c->sp + 2;
+    uint16_t ret_pc = hooks->before[c->sp] |
+        hooks->before[(uint16_t)(c->sp + 1)] << 8;
+
+    // interpreted run, without the hooks (the routine itself is hooked), the
+    // write log and interrupts
+    c->hooks = NULL;
+    c->write_log = NULL;
+    c->interrupt_pending = 0;
+    bool returned = false;
+    while ((unsigned long)(c->cyc - start.cyc) < hooks->max_cycles) {
+        if (c->pc == ret_pc && c->sp == ret_sp) {
+            returned = true;
+            break;
+        }
+        if (c->halted) {
+            break;
+        }
+        i8080_step(c);
+    }
+
+    i8080 interpreted = *c;
+    interpreted.hooks = start.hooks;
+    interpreted.write_log = start.write_log;
+    interpreted.interrupt_pending = start.interrupt_pending;
+    snapshot_memory(c, hooks->after);
+
+    if (!returned) {
+        if (hooks->report != NULL) {
+            fprintf(hooks->report, "hook %04X: the interpreted routine did "
+                "not return (cyc=%lu)\n", h->addr, start.cyc);
+        }
+        *c = interpreted;
+        return;
+    }
+
+    // back to the start, then the native run
+    restore_memory(c, hooks->before, hooks->after);
+    *c = start;
+    call_native(h, c);
+
+    h->validations += 1;
+    int slot = measured_slot(routine_inputs(&start));
+    h->measured_inputs[slot] = routine_inputs(&start);
+    h->measured_cycles[slot] = interpreted.cyc - start.cyc;
+
+    int differences = 0;
+    uint16_t first_difference = 0;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (c->read_byte(c->userdata, (uint16_t)i) != hooks->after[i]) {
+            first_difference = differences == 0 ? (uint16_t)i : first_difference;
+            differences += 1;
+        }
+    }
+
+    if (!same_registers(c, &interpreted) || differences > 0) {
+        h->mismatches += 1;
+        if (hooks->report != NULL) {
+            fprintf(hooks->report, "hook %04X: native result differs "
+                "(cyc=%lu, registers %s, %d bytes of memory from %04X)\n",
+                h->addr, start.cyc,
+                same_registers(c, &interpreted) ? "equal" : "differ",
+                differences, first_difference);
+        }
+        *c = interpreted;
+        snapshot_memory(c, hooks->before);
+        restore_memory(c, hooks->after, hooks->before);
+    }
+    else if (c->cyc != interpreted.cyc) {
+        h->cycle_mismatches += 1;
+        if (hooks->report != NULL) {
+            fprintf(hooks->report, "hook %04X: native cost %lu cycles, "
+                "interpreted %lu (cyc=%lu)\n", h->addr, c->cyc - start.cyc,
+                interpreted.cyc - start.cyc, start.cyc);
+        }
+        c->cyc = interpreted.cyc;
+    }
+}
+
+// called by i8080_step at a hooked address: runs the hook of `c->pc`.
+// Returns false if there is none (the instruction is then executed).
+bool i8080_hooks_call(i8080_hooks* const hooks, i8080* const c) {
+    i8080_hook* const h = i8080_hooks_find(hooks, c->pc);
+    if (h == NULL) {
+        return false;
+    }
+    h->calls += 1;
+
+    if ((h->flags & I8080_HOOK_VALIDATE) || ((h->flags & I8080_HOOK_MEASURE) &&
+        measured(h, routine_inputs(c)) == 0)) {
+        if (hooks->before == NULL) {
+            hooks->before = malloc(MEMORY_SIZE);
+            hooks->after = malloc(MEMORY_SIZE);
+        }
+        if (hooks->before != NULL && hooks->after != NULL) {
+            call_validated(hooks, h, c);
+            return true;
+        }
+    }
+
+    call_native(h, c);
+    return true;
+}
+
+// memory accesses of the native handlers, see emu8080_hooks.h
+uint8_t i8080_hooks_read(i8080* const c, uint16_t addr) {
+    return i8080_rb(c, addr);
+}
+
+void i8080_hooks_write(i8080* const c, uint16_t addr, uint8_t val) {
+    i8080_wb(c, addr, val);
+}
+
+#undef MEMORY_SIZE
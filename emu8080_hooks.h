@@ -0,0 +1,82 @@
+#ifndef I8080_HOOKS_H_
+#define I8080_HOOKS_H_
+
+#include "emu8080.h"
+
+#define I8080_MAX_HOOKS 32
+#define I8080_HOOK_MEASURED 16 // measured costs kept per hook
+
+// hook flags
+#define I8080_HOOK_VALIDATE 0x01 // also run the routine interpreted and compare
+#define I8080_HOOK_MEASURE 0x02 // charge the cycles measured by a validation
+                                // with the same registers at entry (one is
+                                // run if there is none) instead of the
+                                // declared ones
+
+// high-level emulation: a native handler replacing a routine of the program.
+// When the cpu reaches `addr` (the routine's entry point, reached by a CALL
+// or RST), `run` does what the routine does to the registers, flags and
+// memory and returns its cost in cycles (final RET included); the hook then
+// returns to the caller like the RET would. The routine runs as a whole: an
+// interrupt requested meanwhile is serviced after it returns.
+//
+// I8080_HOOK_MEASURE keeps the cost measured for each set of registers at
+// entry (A to L and the flags, the last I8080_HOOK_MEASURED ones), so it
+// suits routines whose length depends on their registers only (like the copy
+// below, on B), not on the memory they read (e.g. a string up to its end).
+//
+// A handler must access memory with i8080_hooks_read and i8080_hooks_write,
+// which go through the same path as the instructions: a write done behind
+// the cpu's back is missed by `dirty_pages` (so by checkpoints and rewind
+// deltas) and by the write log.
+//
+//   // 0x1A32 in space invaders: copies B bytes from (DE) to (HL)
+//   static unsigned long block_copy(i8080* c, void* userdata) {
+//       unsigned n = c->b != 0 ? c->b : 256;
+//       ...
+//           i8080_hooks_write(c, hl++, i8080_hooks_read(c, de++));
+//       ...
+//       return 39 * n + 10;
+//   }
+//   i8080_hooks_add(&hooks, 0x1A32, block_copy, NULL, 0);
+typedef struct i8080_hook {
+	uint16_t addr;
+	unsigned long (*run)(i8080*, void*);
+	void* userdata;
+	unsigned flags;
+
+	// costs of the interpreted runs (0: none), indexed by a hash of the
+	// registers at entry, kept in `measured_inputs`
+	uint64_t measured_inputs[I8080_HOOK_MEASURED];
+	unsigned long measured_cycles[I8080_HOOK_MEASURED];
+	uint64_t calls;
+	uint64_t validations;
+	uint64_t mismatches; // validations where registers or memory differed
+	uint64_t cycle_mismatches; // validations where only the cycles differed
+} i8080_hook;
+
+typedef struct i8080_hooks {
+	uint32_t addresses[0x10000 / 32]; // bitmap of the hooked addresses
+	i8080_hook hooks[I8080_MAX_HOOKS];
+	int count;
+
+	// validation: the interpreted routine is given up after `max_cycles`
+	// (default: 10M), and differences are reported to `report` (default:
+	// stderr, NULL: not reported). When they differ, the interpreted result
+	// is kept.
+	unsigned long max_cycles;
+	FILE* report;
+	uint8_t* before; // memory snapshots (allocated by the first validation)
+	uint8_t* after;
+} i8080_hooks;
+
+void i8080_hooks_init(i8080_hooks* const hooks);
+void i8080_hooks_free(i8080_hooks* const hooks);
+i8080_hook* i8080_hooks_add(i8080_hooks* const hooks, uint16_t addr,
+	unsigned long (*run)(i8080*, void*), void* userdata, unsigned flags);
+i8080_hook* i8080_hooks_find(i8080_hooks* const hooks, uint16_t addr);
+bool i8080_hooks_call(i8080_hooks* const hooks, i8080* const c);
+uint8_t i8080_hooks_read(i8080* const c, uint16_t addr);
+void i8080_hooks_write(i8080* const c, uint16_t addr, uint8_t val);
+
+#endif // I8080_HOOKS_H_
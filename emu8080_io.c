@@ -0,0 +1,205 @@
+// Port handlers backed by lock-free queues, so host devices living on other
+// threads (input, sound, serial...) can talk to the cpu thread without locks.
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080_clock.h"
+#include "emu8080_io.h"
+
+// head/tail accesses: the producer publishes a slot with a release store of
+// `head` that the consumer reads with an acquire load (and conversely for
+// `tail`)
+// (never a read-modify-write: it would write the other thread's cache line)
+#if defined(_MSC_VER) && !defined(__clang__) && defined(_M_ARM64)
+#include <intrin.h>
+#define LOAD_ACQUIRE(p) __ldar32((volatile unsigned __int32*)(p))
+#define STORE_RELEASE(p, v) __stlr32((volatile unsigned __int32*)(p), (v))
+#elif defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// x86 and x64 loads are acquires and stores are releases already, only the
+// compiler must not move memory accesses across them
+static inline uint32_t load_acquire(volatile uint32_t* p) {
+    uint32_t val = *p;
+    _ReadWriteBarrier();
+    return val;
+}
+#define LOAD_ACQUIRE(p) load_acquire(p)
+#define STORE_RELEASE(p, v) (_ReadWriteBarrier(), *(p) = (v))
+#else
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+// initialises an empty queue, `capacity` is rounded up to a power of two (and
+// can't be over 2^31)
+bool i8080_io_queue_init(i8080_io_queue* const q, uint32_t capacity) {
+    memset(q, 0, sizeof(*q));
+    if (capacity > 0x80000000u) {
+        fprintf(stderr, "error: io queue capacity %lu is too large.\n",
+            (unsigned long)capacity);
+        return false;
+    }
+
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    q->events = malloc(size * sizeof(i8080_io_event));
+    q->mask = size - 1;
+    return q->events != NULL;
+}
+
+void i8080_io_queue_free(i8080_io_queue* const q) {
+    free(q->events);
+    q->events = NULL;
+}
+
+// pushes an event (producer thread only), returns false if the queue is full
+bool i8080_io_queue_push(i8080_io_queue* const q, const i8080_io_event* ev) {
+    uint32_t head = q->head;
+    if (head - LOAD_ACQUIRE(&q->tail) > q->mask) {
+        return false;
+    }
+
+    q->events[head & q->mask] = *ev;
+    STORE_RELEASE(&q->head, head + 1);
+    return true;
+}
+
+// pops an event (consumer thread only), returns false if the queue is empty
+bool i8080_io_queue_pop(i8080_io_queue* const q, i8080_io_event* ev) {
+    uint32_t tail = q->tail;
+    if (tail == LOAD_ACQUIRE(&q->head)) {
+        return false;
+    }
+
+    *ev = q->events[tail & q->mask];
+    STORE_RELEASE(&q->tail, tail + 1);
+    return true;
+}
+
+// input device
+
+bool i8080_io_input_init(i8080_io_input* const in, uint32_t capacity) {
+    memset(in, 0, sizeof(*in));
+    return i8080_io_queue_init(&in->queue, capacity);
+}
+
+void i8080_io_input_free(i8080_io_input* const in) {
+    i8080_io_queue_free(&in->queue);
+}
+
+// pushes a new value for a port (host thread), timestamped with the host clock
+bool i8080_io_input_push(i8080_io_input* const in, uint8_t port, uint8_t value) {
+    i8080_io_event ev = { i8080_clock_ns(), port, value };
+    return i8080_io_queue_push(&in->queue, &ev);
+}
+
+static void record_latency(i8080_io_latency* const l, uint64_t ns) {
+    int bucket = 0;
+    while (bucket < 31 && (ns >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+
+    l->count += 1;
+    l->total_ns += ns;
+    l->buckets[bucket] += 1;
+    if (ns > l->max_ns) {
+        l->max_ns = ns;
+    }
+}
+
+// queues an event on its port, dropping the oldest value if it is full
+static void add_pending(i8080_io_input* const in, const i8080_io_event* ev) {
+    i8080_io_pending* const p = &in->pending[ev->port];
+    if (p->count == I8080_IO_PENDING) {
+        p->first = (p->first + 1) % I8080_IO_PENDING;
+        p->count -= 1;
+        in->dropped += 1;
+    }
+
+    int slot = (p->first + p->count) % I8080_IO_PENDING;
+    p->values[slot] = ev->value;
+    p->pushed_ns[slot] = ev->time_ns;
+    p->count += 1;
+}
+
+// port handler: files the events received on their ports, then moves the
+// latch of `port` to its next value (one per read, so none is skipped)
+static uint8_t input_read(void* userdata, uint8_t port) {
+    i8080_io_input* const in = userdata;
+    i8080_io_event ev;
+
+    while (i8080_io_queue_pop(&in->queue, &ev)) {
+        add_pending(in, &ev);
+    }
+
+    i8080_io_pending* const p = &in->pending[port];
+    if (p->count > 0) {
+        in->latch[port] = p->values[p->first];
+        record_latency(&in->latency, i8080_clock_ns() - p->pushed_ns[p->first]);
+        p->first = (p->first + 1) % I8080_IO_PENDING;
+        p->count -= 1;
+    }
+
+    return in->latch[port];
+}
+
+// routes the IN instructions on `port` to the input device
+void i8080_io_input_attach(
+    i8080_io_input* const in, i8080_port* ports, uint8_t port) {
+    ports[port].in = input_read;
+    ports[port].in_userdata = in;
+}
+
+// writes the latencies to `f` as text, one "name value" line per counter
+// (the histogram buckets only when not zero)
+void i8080_io_latency_export(const i8080_io_latency* const l, FILE* f) {
+    fprintf(f, "io_latency.count %llu\n", (unsigned long long)l->count);
+    fprintf(f, "io_latency.mean_ns %.0f\n",
+        l->count > 0 ? (double)l->total_ns / l->count : 0.0);
+    fprintf(f, "io_latency.max_ns %llu\n", (unsigned long long)l->max_ns);
+    for (int b = 0; b < 32; b++) {
+        if (l->buckets[b] != 0) {
+            fprintf(f, "io_latency.bucket%02d %llu\n", b,
+                (unsigned long long)l->buckets[b]);
+        }
+    }
+}
+
+// output device
+
+bool i8080_io_output_init(i8080_io_output* const out, uint32_t capacity) {
+    out->dropped = 0;
+    return i8080_io_queue_init(&out->queue, capacity);
+}
+
+void i8080_io_output_free(i8080_io_output* const out) {
+    i8080_io_queue_free(&out->queue);
+}
+
+// pops the next value written by the cpu (host thread)
+bool i8080_io_output_pop(i8080_io_output* const out, i8080_io_event* ev) {
+    return i8080_io_queue_pop(&out->queue, ev);
+}
+
+// port handler: pushes the written value to the host
+static void output_write(void* userdata, uint8_t port, uint8_t value) {
+    i8080_io_output* const out = userdata;
+    i8080_io_event ev = { i8080_clock_ns(), port, value };
+
+    if (!i8080_io_queue_push(&out->queue, &ev)) {
+        out->dropped += 1;
+    }
+}
+
+// routes the OUT instructions on `port` to the output device
+void i8080_io_output_attach(
+    i8080_io_output* const out, i8080_port* ports, uint8_t port) {
+    ports[port].out = output_write;
+    ports[port].out_userdata = out;
+}
+
+#undef LOAD_ACQUIRE
+#undef STORE_RELEASE
@@ -0,0 +1,81 @@
+#ifndef I8080_IO_H_
+#define I8080_IO_H_
+
+#include "emu8080.h"
+
+// an event exchanged between a host thread and the cpu thread
+typedef struct i8080_io_event {
+	uint64_t time_ns; // host time when the event was pushed (i8080_clock_ns)
+	uint8_t port;
+	uint8_t value;
+} i8080_io_event;
+
+// lock-free single-producer/single-consumer queue: exactly one thread pushes
+// and exactly one other thread pops, neither of them ever blocks
+typedef struct i8080_io_queue {
+	i8080_io_event* events;
+	uint32_t mask; // capacity - 1 (capacity is a power of two)
+	uint8_t pad0[64]; // keeps head and tail on separate cache lines
+	volatile uint32_t head; // next slot to write, owned by the producer
+	uint8_t pad1[64];
+	volatile uint32_t tail; // next slot to read, owned by the consumer
+	uint8_t pad2[64];
+} i8080_io_queue;
+
+// latency from a host input event to the IN instruction that first reads it
+typedef struct i8080_io_latency {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[32]; // bucket n counts latencies in [2^n, 2^(n+1)) ns
+} i8080_io_latency;
+
+#define I8080_IO_PENDING 8 // values kept per port between two reads
+
+// values pushed for a port and not read yet, oldest first
+typedef struct i8080_io_pending {
+	uint8_t values[I8080_IO_PENDING];
+	uint64_t pushed_ns[I8080_IO_PENDING];
+	uint8_t first;
+	uint8_t count;
+} i8080_io_pending;
+
+// input device: host threads push (port, value) events, and each IN on an
+// attached port reads the next value pushed for that port (or the last one
+// read if there is none), so a press and release pushed between two reads
+// are both seen. Past I8080_IO_PENDING values waiting on a port, the oldest
+// is dropped.
+typedef struct i8080_io_input {
+	i8080_io_queue queue;
+	uint8_t latch[256]; // last value read per port
+	i8080_io_pending pending[256]; // values not read yet, per port
+	uint64_t dropped; // values dropped from a full `pending`
+	i8080_io_latency latency; // updated by the cpu thread
+} i8080_io_input;
+
+// output device: OUT instructions on the attached ports push events that a
+// host thread pops
+typedef struct i8080_io_output {
+	i8080_io_queue queue;
+	uint64_t dropped; // events lost because the queue was full
+} i8080_io_output;
+
+bool i8080_io_queue_init(i8080_io_queue* const q, uint32_t capacity);
+void i8080_io_queue_free(i8080_io_queue* const q);
+bool i8080_io_queue_push(i8080_io_queue* const q, const i8080_io_event* ev);
+bool i8080_io_queue_pop(i8080_io_queue* const q, i8080_io_event* ev);
+
+bool i8080_io_input_init(i8080_io_input* const in, uint32_t capacity);
+void i8080_io_input_free(i8080_io_input* const in);
+bool i8080_io_input_push(i8080_io_input* const in, uint8_t port, uint8_t value);
+void i8080_io_input_attach(i8080_io_input* const in, i8080_port* ports,
+	uint8_t port);
+void i8080_io_latency_export(const i8080_io_latency* const l, FILE* f);
+
+bool i8080_io_output_init(i8080_io_output* const out, uint32_t capacity);
+void i8080_io_output_free(i8080_io_output* const out);
+bool i8080_io_output_pop(i8080_io_output* const out, i8080_io_event* ev);
+void i8080_io_output_attach(i8080_io_output* const out, i8080_port* ports,
+	uint8_t port);
+
+#endif // I8080_IO_H_
@@ -0,0 +1,406 @@
+#ifndef I8080_OPS_H_
+#define I8080_OPS_H_
+
+// The building blocks of the interpreter (cycle table, memory, register and
+// flag helpers, opcode semantics), shared with the code generated by
+// emu8080_recomp so that translated code behaves exactly the same.
+
+#include "emu8080.h"
+#include "emu8080_writelog.h"
+
+// this array defines the number of cycles one opcode takes.
+// note that there are some special cases: conditional RETs and CALLs
+// add +6 cycles if the condition is met
+// clang-format off
+static const uint8_t OPCODES_CYCLES[256] = {
+    //  0  1   2   3   4   5   6   7   8  9   A   B   C   D   E  F
+        4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 0
+        4, 10, 7,  5,  5,  5,  7,  4,  4, 10, 7,  5,  5,  5,  7, 4,  // 1
+        4, 10, 16, 5,  5,  5,  7,  4,  4, 10, 16, 5,  5,  5,  7, 4,  // 2
+        4, 10, 13, 5,  10, 10, 10, 4,  4, 10, 13, 5,  5,  5,  7, 4,  // 3
+        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 4
+        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 5
+        5, 5,  5,  5,  5,  5,  7,  5,  5, 5,  5,  5,  5,  5,  7, 5,  // 6
+        7, 7,  7,  7,  7,  7,  7,  7,  5, 5,  5,  5,  5,  5,  7, 5,  // 7
+        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // 8
+        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // 9
+        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // A
+        4, 4,  4,  4,  4,  4,  7,  4,  4, 4,  4,  4,  4,  4,  7, 4,  // B
+        5, 10, 10, 10, 11, 11, 7,  11, 5, 10, 10, 10, 11, 17, 7, 11, // C
+        5, 10, 10, 10, 11, 11, 7,  11, 5, 10, 10, 10, 11, 17, 7, 11, // D
+        5, 10, 10, 18, 11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11, // E
+        5, 10, 10, 4,  11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11  // F
+};
+// clang-format on
+
+#define SET_ZSP(c, val) \
+  do { \
+    c->zf = (val) == 0; \
+    c->sf = (val) >> 7; \
+    c->pf = parity(val); \
+  } while (0)
+
+// updates a hot path counter (compiled out without I8080_STATS)
+#ifdef I8080_STATS
+#define STAT(expr) (expr)
+#define STAT_PORT(counters, port) i8080_count_port(counters, port)
+#else
+#define STAT(expr) ((void)0)
+#define STAT_PORT(counters, port) (port)
+#endif
+
+#ifdef I8080_STATS
+// counts an access to a port and returns the port number
+static inline uint8_t i8080_count_port(uint64_t* const counters, uint8_t port) {
+    counters[port]++;
+    return port;
+}
+#endif
+
+// marks the page containing `addr` as written
+#define MARK_DIRTY(c, addr) \
+  ((c)->dirty_pages[(addr) >> 13] |= 1u << (((addr) >> 8) & 31))
+
+// memory helpers (the only four to use `read_byte` and `write_byte` function
+// pointers)
+
+// reads a byte from memory
+static inline uint8_t i8080_rb(i8080* const c, uint16_t addr) {
+    STAT(c->stats.reads[addr >> 8]++);
+    return c->read_byte(c->userdata, addr);
+}
+
+// writes a byte to memory
+static inline void i8080_wb(i8080* const c, uint16_t addr, uint8_t val) {
+    MARK_DIRTY(c, addr);
+    STAT(c->stats.writes[addr >> 8]++);
+    if (c->write_log != NULL) {
+        i8080_writelog_record(c->write_log, c, addr, val);
+    }
+    c->write_byte(c->userdata, addr, val);
+}
+
+// reads a word from memory
+static inline uint16_t i8080_rw(i8080* const c, uint16_t addr) {
+    STAT(c->stats.reads[addr >> 8]++);
+    STAT(c->stats.reads[(uint16_t)(addr + 1) >> 8]++);
+    return c->read_byte(c->userdata, addr + 1) << 8 |
+        c->read_byte(c->userdata, addr);
+}
+
+// writes a word to memory
+static inline void i8080_ww(i8080* const c, uint16_t addr, uint16_t val) {
+    MARK_DIRTY(c, addr);
+    MARK_DIRTY(c, (uint16_t)(addr + 1));
+    STAT(c->stats.writes[addr >> 8]++);
+    STAT(c->stats.writes[(uint16_t)(addr + 1) >> 8]++);
+    if (c->write_log != NULL) {
+        i8080_writelog_record(c->write_log, c, addr, val & 0xFF);
+    }
+    c->write_byte(c->userdata, addr, val & 0xFF);
+    if (c->write_log != NULL) {
+        i8080_writelog_record(c->write_log, c, addr + 1, val >> 8);
+    }
+    c->write_byte(c->userdata, addr + 1, val >> 8);
+}
+
+// reads a byte from a port, through the port table if it has a handler
+static inline uint8_t i8080_in(i8080* const c, uint8_t port) {
+    if (c->ports != NULL && c->ports[port].in != NULL) {
+        return c->ports[port].in(c->ports[port].in_userdata, port);
+    }
+    return c->port_in(c->userdata, port);
+}
+
+// writes a byte to a port, through the port table if it has a handler
+static inline void i8080_out(i8080* const c, uint8_t port, uint8_t val) {
+    if (c->ports != NULL && c->ports[port].out != NULL) {
+        c->ports[port].out(c->ports[port].out_userdata, port, val);
+        return;
+    }
+    c->port_out(c->userdata, port, val);
+}
+
+// returns the next byte in memory (and updates the program counter)
+static inline uint8_t i8080_next_byte(i8080* const c) {
+    return i8080_rb(c, c->pc++);
+}
+
+// returns the next word in memory (and updates the program counter)
+static inline uint16_t i8080_next_word(i8080* const c) {
+    uint16_t result = i8080_rw(c, c->pc);
+    c->pc += 2;
+    return result;
+}
+
+// paired registers helpers (setters and getters)
+static inline void i8080_set_bc(i8080* const c, uint16_t val) {
+    c->b = val >> 8;
+    c->c = val & 0xFF;
+}
+
+static inline void i8080_set_de(i8080* const c, uint16_t val) {
+    c->d = val >> 8;
+    c->e = val & 0xFF;
+}
+
+static inline void i8080_set_hl(i8080* const c, uint16_t val) {
+    c->h = val >> 8;
+    c->l = val & 0xFF;
+}
+
+static inline uint16_t i8080_get_bc(i8080* const c) {
+    return (c->b << 8) | c->c;
+}
+
+static inline uint16_t i8080_get_de(i8080* const c) {
+    return (c->d << 8) | c->e;
+}
+
+static inline uint16_t i8080_get_hl(i8080* const c) {
+    return (c->h << 8) | c->l;
+}
+
+// stack helpers
+
+// pushes a value into the stack and updates the stack pointer
+static inline void i8080_push_stack(i8080* const c, uint16_t val) {
+    c->sp -= 2;
+    i8080_ww(c, c->sp, val);
+}
+
+// pops a value from the stack and updates the stack pointer
+static inline uint16_t i8080_pop_stack(i8080* const c) {
+    uint16_t val = i8080_rw(c, c->sp);
+    c->sp += 2;
+    return val;
+}
+
+// opcodes
+
+// returns the parity of byte: 0 if number of 1 bits in `val` is odd, else 1
+static inline bool parity(uint8_t val) {
+    uint8_t nb_one_bits = 0;
+    for (int i = 0; i < 8; i++) {
+        nb_one_bits += ((val >> i) & 1);
+    }
+
+    return (nb_one_bits & 1) == 0;
+}
+
+// returns if there was a carry between bit "bit_no" and "bit_no - 1" when
+// executing "a + b + cy"
+static inline bool carry(int bit_no, uint8_t a, uint8_t b, bool cy) {
+    int16_t result = a + b + cy;
+    int16_t carry = result ^ a ^ b;
+    return carry & (1 << bit_no);
+}
+
+// adds a value (+ an optional carry flag) to a register
+static inline void i8080_add(
+    i8080* const c, uint8_t* const reg, uint8_t val, bool cy) {
+    uint8_t result = *reg + val + cy;
+    c->cf = carry(8, *reg, val, cy);
+    c->hf = carry(4, *reg, val, cy);
+    SET_ZSP(c, result);
+    *reg = result;
+}
+
+// substracts a byte (+ an optional carry flag) from a register
+// see https://stackoverflow.com/a/8037485
+static inline void i8080_sub(
+    i8080* const c, uint8_t* const reg, uint8_t val, bool cy) {
+    i8080_add(c, reg, ~val, !cy);
+    c->cf = !c->cf;
+}
+
+// adds a word to HL
+static inline void i8080_dad(i8080* const c, uint16_t val) {
+    c->cf = ((i8080_get_hl(c) + val) >> 16) & 1;
+    i8080_set_hl(c, i8080_get_hl(c) + val);
+}
+
+// increments a byte
+static inline uint8_t i8080_inr(i8080* const c, uint8_t val) {
+    uint8_t result = val + 1;
+    c->hf = (result & 0xF) == 0;
+    SET_ZSP(c, result);
+    return result;
+}
+
+// decrements a byte
+static inline uint8_t i8080_dcr(i8080* const c, uint8_t val) {
+    uint8_t result = val - 1;
+    c->hf = !((result & 0xF) == 0xF);
+    SET_ZSP(c, result);
+    return result;
+}
+
+// executes a logic "and" between register A and a byte, then stores the
+// result in register A
+static inline void i8080_ana(i8080* const c, uint8_t val) {
+    uint8_t result = c->a & val;
+    c->cf = 0;
+    c->hf = ((c->a | val) & 0x08) != 0;
+    SET_ZSP(c, result);
+    c->a = result;
+}
+
+// executes a logic "xor" between register A and a byte, then stores the
+// result in register A
+static inline void i8080_xra(i8080* const c, uint8_t val) {
+    c->a ^= val;
+    c->cf = 0;
+    c->hf = 0;
+    SET_ZSP(c, c->a);
+}
+
+// executes a logic "or" between register A and a byte, then stores the
+// result in register A
+static inline void i8080_ora(i8080* const c, uint8_t val) {
+    c->a |= val;
+    c->cf = 0;
+    c->hf = 0;
+    SET_ZSP(c, c->a);
+}
+
+// compares the register A to another byte
+static inline void i8080_cmp(i8080* const c, uint8_t val) {
+    int16_t result = c->a - val;
+    c->cf = result >> 8;
+    c->hf = ~(c->a ^ result ^ val) & 0x10;
+    SET_ZSP(c, result & 0xFF);
+}
+
+// sets the program counter to a given address
+static inline void i8080_jmp(i8080* const c, uint16_t addr) {
+    c->pc = addr;
+}
+
+// jumps to next address pointed by the next word in memory if a condition
+// is met
+static inline void i8080_cond_jmp(i8080* const c, bool condition) {
+    uint16_t addr = i8080_next_word(c);
+    if (condition) {
+        c->pc = addr;
+    }
+}
+
+// pushes the current pc to the stack, then jumps to an address
+static inline void i8080_call(i8080* const c, uint16_t addr) {
+    i8080_push_stack(c, c->pc);
+    i8080_jmp(c, addr);
+}
+
+// calls to next word in memory if a condition is met
+static inline void i8080_cond_call(i8080* const c, bool condition) {
+    uint16_t addr = i8080_next_word(c);
+    if (condition) {
+        i8080_call(c, addr);
+        c->cyc += 6;
+    }
+}
+
+// returns from subroutine
+static inline void i8080_ret(i8080* const c) {
+    c->pc = i8080_pop_stack(c);
+}
+
+// returns from subroutine if a condition is met
+static inline void i8080_cond_ret(i8080* const c, bool condition) {
+    if (condition) {
+        i8080_ret(c);
+        c->cyc += 6;
+    }
+}
+
+// pushes register A and the flags into the stack
+static inline void i8080_push_psw(i8080* const c) {
+    // note: bit 3 and 5 are always 0
+    uint8_t psw = 0;
+    psw |= c->sf << 7;
+    psw |= c->zf << 6;
+    psw |= c->hf << 4;
+    psw |= c->pf << 2;
+    psw |= 1 << 1; // bit 1 is always 1
+    psw |= c->cf << 0;
+    i8080_push_stack(c, c->a << 8 | psw);
+}
+
+// pops register A and the flags from the stack
+static inline void i8080_pop_psw(i8080* const c) {
+    uint16_t af = i8080_pop_stack(c);
+    c->a = af >> 8;
+    uint8_t psw = af & 0xFF;
+
+    c->sf = (psw >> 7) & 1;
+    c->zf = (psw >> 6) & 1;
+    c->hf = (psw >> 4) & 1;
+    c->pf = (psw >> 2) & 1;
+    c->cf = (psw >> 0) & 1;
+}
+
+// rotate register A left
+static inline void i8080_rlc(i8080* const c) {
+    c->cf = c->a >> 7;
+    c->a = (c->a << 1) | c->cf;
+}
+
+// rotate register A right
+static inline void i8080_rrc(i8080* const c) {
+    c->cf = c->a & 1;
+    c->a = (c->a >> 1) | (c->cf << 7);
+}
+
+// rotate register A left with the carry flag
+static inline void i8080_ral(i8080* const c) {
+    bool cy = c->cf;
+    c->cf = c->a >> 7;
+    c->a = (c->a << 1) | cy;
+}
+
+// rotate register A right with the carry flag
+static inline void i8080_rar(i8080* const c) {
+    bool cy = c->cf;
+    c->cf = c->a & 1;
+    c->a = (c->a >> 1) | (cy << 7);
+}
+
+// Decimal Adjust Accumulator: the eight-bit number in register A is adjusted
+// to form two four-bit binary-coded-decimal digits.
+// For example, if A=$2B and DAA is executed, A becomes $31.
+static inline void i8080_daa(i8080* const c) {
+    bool cy = c->cf;
+    uint8_t correction = 0;
+
+    uint8_t lsb = c->a & 0x0F;
+    uint8_t msb = c->a >> 4;
+
+    if (c->hf || lsb > 9) {
+        correction += 0x06;
+    }
+
+    if (c->cf || msb > 9 || (msb >= 9 && lsb > 9)) {
+        correction += 0x60;
+        cy = 1;
+    }
+
+    i8080_add(c, &c->a, correction, 0);
+    c->cf = cy;
+}
+
+// switches the value of registers DE and HL
+static inline void i8080_xchg(i8080* const c) {
+    uint16_t de = i8080_get_de(c);
+    i8080_set_de(c, i8080_get_hl(c));
+    i8080_set_hl(c, de);
+}
+
+// switches the value of a word at (sp) and HL
+static inline void i8080_xthl(i8080* const c) {
+    uint16_t val = i8080_rw(c, c->sp);
+    i8080_ww(c, c->sp, i8080_get_hl(c));
+    i8080_set_hl(c, val);
+}
+
+#endif // I8080_OPS_H_
@@ -0,0 +1,126 @@
+// Real-time pacing: runs the cpu frame by frame, each frame being split in
+// cycle budgets, then waits for the frame deadline on the host clock. When
+// the host falls behind (a stall), frames are run back to back until the
+// emulation has caught up, or the deadlines are reset if it is too late.
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080_clock.h"
+#include "emu8080_pacing.h"
+
+// initialises the pacer with default values (2 MHz, 60 Hz, 1 slice)
+void i8080_pacer_init(i8080_pacer* const p, i8080* const c) {
+    memset(p, 0, sizeof(*p));
+    p->clock_hz = 2000000;
+    p->frame_hz = 60;
+    p->slices = 1;
+    p->spin_ns = 200000;
+    p->max_catchup = 10;
+    p->start_cyc = c->cyc;
+}
+
+// returns the host time offset of the start of frame `frame`
+static uint64_t frame_offset_ns(const i8080_pacer* const p, uint64_t frame) {
+    return frame * 1000000000ULL / p->frame_hz;
+}
+
+// returns the cycle count at which slice `slice` of the current frame ends
+static unsigned long slice_end(const i8080_pacer* const p, unsigned slice) {
+    uint64_t nb_slices = p->frames * p->slices + slice + 1;
+    uint64_t slices_per_second = (uint64_t)p->frame_hz * p->slices;
+    return p->start_cyc +
+        (unsigned long)(nb_slices * p->clock_hz / slices_per_second);
+}
+
+// steps the cpu until it reaches cycle `target` (wrap-around safe). A halted
+// cpu that can't be woken up by an interrupt jumps straight to `target`.
+// c->next_event is lowered to `target` meanwhile, so that fused pairs and
+// batched loops stop there.
+static void run_until(i8080* const c, unsigned long target) {
+    const unsigned long next_event = c->next_event;
+    if (next_event == 0 || (long)(next_event - target) > 0) {
+        c->next_event = target;
+    }
+
+    while ((long)(target - c->cyc) > 0) {
+        if (c->halted &&
+            !(c->interrupt_pending && c->iff && c->interrupt_delay == 0)) {
+            c->cyc = target;
+            break;
+        }
+        i8080_step(c);
+    }
+    c->next_event = next_event;
+}
+
+// runs one frame of emulation and waits until it is time to run the next
+void i8080_pacer_run_frame(i8080_pacer* const p, i8080* const c) {
+    if (p->frames == 0) {
+        p->start_ns = p->epoch_ns = p->last_frame_ns = i8080_clock_ns();
+        p->start_cpu_ns = i8080_clock_cpu_ns();
+    }
+
+    for (unsigned i = 0; i < p->slices; i++) {
+        run_until(c, slice_end(p, i));
+        if (p->on_slice != NULL) {
+            p->on_slice(c, p->userdata, i);
+        }
+    }
+    p->frames += 1;
+
+    uint64_t deadline = p->epoch_ns + frame_offset_ns(p, p->frames);
+    uint64_t late_limit = frame_offset_ns(p, p->max_catchup);
+    uint64_t now = i8080_clock_ns();
+
+    if (now > deadline + late_limit) {
+        p->epoch_ns = now - frame_offset_ns(p, p->frames);
+        p->resyncs += 1;
+    }
+    else if (now < deadline) {
+        i8080_clock_sleep_until(deadline, p->spin_ns);
+    }
+
+    now = i8080_clock_ns();
+    p->frame_ns[(p->frames - 1) % I8080_PACER_HISTORY] = now - p->last_frame_ns;
+    p->last_frame_ns = now;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// computes the frame jitter percentiles (over the last I8080_PACER_HISTORY
+// frames) and the host cpu utilisation. Call it from the emulation thread.
+void i8080_pacer_get_stats(
+    const i8080_pacer* const p, i8080_pacer_stats* const stats) {
+    uint64_t jitter[I8080_PACER_HISTORY]; // 8 KiB, local to stay reentrant
+    uint64_t period = frame_offset_ns(p, 1);
+    size_t n = p->frames < I8080_PACER_HISTORY ? (size_t)p->frames
+                                               : I8080_PACER_HISTORY;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->frames = p->frames;
+    stats->resyncs = p->resyncs;
+    if (n == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t d = p->frame_ns[i];
+        jitter[i] = d > period ? d - period : period - d;
+    }
+    qsort(jitter, n, sizeof(jitter[0]), compare_u64);
+
+    stats->jitter_p50_ns = jitter[(n - 1) * 50 / 100];
+    stats->jitter_p90_ns = jitter[(n - 1) * 90 / 100];
+    stats->jitter_p99_ns = jitter[(n - 1) * 99 / 100];
+    stats->jitter_max_ns = jitter[n - 1];
+
+    uint64_t wall = i8080_clock_ns() - p->start_ns;
+    if (wall > 0) {
+        stats->cpu_utilisation =
+            (double)(i8080_clock_cpu_ns() - p->start_cpu_ns) / wall;
+    }
+}
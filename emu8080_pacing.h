@@ -0,0 +1,44 @@
+#ifndef I8080_PACING_H_
+#define I8080_PACING_H_
+
+#include "emu8080.h"
+
+#define I8080_PACER_HISTORY 1024 // number of frame times kept for the stats
+
+// runs the cpu in real time, one frame at a time. Each frame is cut in
+// `slices` equal cycle budgets, and `on_slice` is called at the end of each
+// of them (e.g. for space invaders: 2 slices, RST 1 at mid-screen and RST 2
+// at vblank).
+typedef struct i8080_pacer {
+	unsigned long clock_hz; // emulated clock (default: 2 MHz)
+	unsigned frame_hz; // frames per second (default: 60)
+	unsigned slices; // slices per frame (default: 1)
+	uint64_t spin_ns; // busy-wait for the end of each wait (default: 200us)
+	unsigned max_catchup; // frames late before giving up catching up
+	void (*on_slice)(i8080*, void*, unsigned); // called after each slice
+	void* userdata;
+
+	uint64_t frames; // frames run since the start
+	unsigned long start_cyc;
+	uint64_t start_ns, start_cpu_ns; // host times of the first frame
+	uint64_t epoch_ns; // host time of frame 0 (moved forward on resyncs)
+	uint64_t last_frame_ns; // host time the last frame ended
+	uint64_t resyncs; // stalls too long to be caught up
+
+	uint64_t frame_ns[I8080_PACER_HISTORY]; // last frame durations
+} i8080_pacer;
+
+typedef struct i8080_pacer_stats {
+	uint64_t frames;
+	uint64_t resyncs;
+	// absolute difference between a frame duration and the frame period
+	uint64_t jitter_p50_ns, jitter_p90_ns, jitter_p99_ns, jitter_max_ns;
+	double cpu_utilisation; // host cpu time / wall time, since the start
+} i8080_pacer_stats;
+
+void i8080_pacer_init(i8080_pacer* const p, i8080* const c);
+void i8080_pacer_run_frame(i8080_pacer* const p, i8080* const c);
+void i8080_pacer_get_stats(const i8080_pacer* const p,
+	i8080_pacer_stats* const stats);
+
+#endif // I8080_PACING_H_
@@ -0,0 +1,463 @@
+// Ahead-of-time recompiler: translates the code reachable in a fixed ROM into
+// a C function that runs it natively, instruction by instruction, with the
+// exact flag and cycle semantics of the interpreter (the generated code uses
+// the helpers of emu8080_ops.h).
+//
+// usage: emu8080_recomp [-o output.c] [-n name] [-a load_addr] [-e entry]...
+//                       rom_file...
+//
+// The ROM files are loaded one after the other from `load_addr` (default 0).
+// Code is discovered from the entry points (default: 0x0000 and the RST
+// vectors) by following jumps, calls and fall-throughs. The generated file
+// defines:
+//
+//   void <name>_run(i8080* const c, unsigned long until);
+//
+// which runs the cpu until `until` cycles like a loop of i8080_step would:
+// translated code is used for the discovered instructions, and i8080_step
+// for the rest (RAM-resident code, targets of PCHL and computed RETs that
+// were not discovered, interrupt servicing). The ROM must never be written.
+// Built with I8080_STATS, the translated code updates the same counters as
+// the interpreter. emu8080_recomp_check.c compares the two.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "emu8080_file.h"
+
+#define MEMORY_SIZE 0x10000
+#define MAX_ENTRIES 64
+
+static uint8_t rom[MEMORY_SIZE];
+static bool in_rom[MEMORY_SIZE];
+static bool is_start[MEMORY_SIZE]; // address of a discovered instruction
+
+static const char* REGS[8] = { "c->b", "c->c", "c->d", "c->e", "c->h", "c->l",
+    NULL, "c->a" };
+static const char* CONDITIONS[8] = { "c->zf == 0", "c->zf == 1", "c->cf == 0",
+    "c->cf == 1", "c->pf == 0", "c->pf == 1", "c->sf == 0", "c->sf == 1" };
+static const char* ALU_OPS[8] = { "i8080_add(c, &c->a, %s, 0);",
+    "i8080_add(c, &c->a, %s, c->cf);", "i8080_sub(c, &c->a, %s, 0);",
+    "i8080_sub(c, &c->a, %s, c->cf);", "i8080_ana(c, %s);", "i8080_xra(c, %s);",
+    "i8080_ora(c, %s);", "i8080_cmp(c, %s);" };
+static const char* PAIRS_GET[4] = { "i8080_get_bc(c)", "i8080_get_de(c)",
+    "i8080_get_hl(c)", "c->sp" };
+static const char* PAIRS_SET[4] = { "i8080_set_bc(c, %s);",
+    "i8080_set_de(c, %s);", "i8080_set_hl(c, %s);", "c->sp = %s;" };
+
+#define MEM_HL "i8080_rb(c, i8080_get_hl(c))"
+
+// returns the length of an instruction in bytes
+static int instruction_length(uint8_t op) {
+    switch (op) {
+    case 0x01: case 0x11: case 0x21: case 0x31: // LXI
+    case 0x22: case 0x2A: case 0x32: case 0x3A: // SHLD, LHLD, STA, LDA
+    case 0xC3: case 0xCB: case 0xCD: case 0xDD: case 0xED: case 0xFD:
+        return 3;
+    case 0xD3: case 0xDB: // OUT, IN
+        return 2;
+    }
+    if ((op & 0xC7) == 0x06 || (op & 0xC7) == 0xC6) { // MVI, ALU immediate
+        return 2;
+    }
+    if ((op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4) { // Jcc, Ccc
+        return 3;
+    }
+    return 1;
+}
+
+// returns true if the execution never continues after the instruction
+static bool ends_flow(uint8_t op) {
+    return op == 0xC3 || op == 0xCB || op == 0xC9 || op == 0xD9 || op == 0xE9;
+}
+
+// returns the address an instruction may jump or call to, -1 if none
+static int branch_target(uint16_t addr, uint8_t op) {
+    uint16_t word = rom[(uint16_t)(addr + 1)] | rom[(uint16_t)(addr + 2)] << 8;
+
+    if (op == 0xC3 || op == 0xCB || op == 0xCD || op == 0xDD || op == 0xED ||
+        op == 0xFD || (op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4) {
+        return word;
+    }
+    if ((op & 0xC7) == 0xC7) { // RST
+        return op & 0x38;
+    }
+    return -1;
+}
+
+// marks every instruction reachable from `entry`
+static void discover(uint16_t entry) {
+    static uint16_t worklist[MEMORY_SIZE];
+    int nb = 0;
+    worklist[nb++] = entry;
+
+    while (nb > 0) {
+        uint16_t addr = worklist[--nb];
+        while (in_rom[addr] && !is_start[addr]) {
+            uint8_t op = rom[addr];
+            int len = instruction_length(op);
+            if (!in_rom[(uint16_t)(addr + len - 1)]) {
+                break; // instruction straddling the end of the ROM
+            }
+            is_start[addr] = true;
+
+            int target = branch_target(addr, op);
+            if (target >= 0 && in_rom[target] && !is_start[target]) {
+                worklist[nb++] = (uint16_t)target;
+            }
+            if (ends_flow(op)) {
+                break;
+            }
+            addr += len;
+        }
+    }
+}
+
+// emits the jump to the translated instruction at `addr` (or back to the
+// dispatcher if there is none), checking first that nothing has to stop
+// the translated code
+static void emit_next(FILE* out, const char* indent, uint16_t addr) {
+    if (is_start[addr]) {
+        fprintf(out, "%sif (STOP() || c->hooks != NULL) continue;\n", indent);
+        fprintf(out, "%sgoto L_%04X;\n", indent, addr);
+    }
+    else {
+        fprintf(out, "%scontinue;\n", indent);
+    }
+}
+
+// emits the counting of the reads done by the interpreter to fetch the
+// instruction at `addr` (grouped by page)
+static void emit_fetch_stats(FILE* out, uint16_t addr, int len) {
+    int i = 0;
+    while (i < len) {
+        int page = (uint16_t)(addr + i) >> 8;
+        int n = 0;
+        while (i < len && (uint16_t)(addr + i) >> 8 == page) {
+            n++;
+            i++;
+        }
+        fprintf(out, "    STAT(c->stats.reads[0x%02X] += %d);\n", page, n);
+    }
+}
+
+// emits the code of one instruction
+static void emit_instruction(FILE* out, uint16_t addr) {
+    uint8_t op = rom[addr];
+    int len = instruction_length(op);
+    uint8_t byte = rom[(uint16_t)(addr + 1)];
+    uint16_t word = byte | rom[(uint16_t)(addr + 2)] << 8;
+    uint16_t next = addr + len;
+    int dst = (op >> 3) & 7;
+    int src = op & 7;
+    char operand[64];
+
+    fprintf(out, "L_%04X: //", addr);
+    for (int i = 0; i < len; i++) {
+        fprintf(out, " %02X", rom[(uint16_t)(addr + i)]);
+    }
+    fprintf(out, "\n    c->pc = 0x%04X;\n", next);
+    fprintf(out, "    c->cyc += OPCODES_CYCLES[0x%02X];\n", op);
+    fprintf(out, "    STAT(c->stats.instructions++);\n");
+    fprintf(out, "    STAT(c->stats.interrupt_delay_stalls += "
+        "c->interrupt_pending && c->iff);\n");
+    emit_fetch_stats(out, addr, len);
+    fprintf(out, "    DELAY();\n");
+
+    if (op >= 0x40 && op <= 0x7F && op != 0x76) { // MOV
+        const char* from = src == 6 ? MEM_HL : REGS[src];
+        if (dst == 6) {
+            fprintf(out, "    i8080_wb(c, i8080_get_hl(c), %s);\n", from);
+        }
+        else {
+            fprintf(out, "    %s = %s;\n", REGS[dst], from);
+        }
+    }
+    else if ((op & 0xC7) == 0x06) { // MVI
+        if (dst == 6) {
+            fprintf(out, "    i8080_wb(c, i8080_get_hl(c), 0x%02X);\n", byte);
+        }
+        else {
+            fprintf(out, "    %s = 0x%02X;\n", REGS[dst], byte);
+        }
+    }
+    else if ((op & 0xC7) == 0x04 || (op & 0xC7) == 0x05) { // INR, DCR
+        const char* fn = (op & 1) ? "i8080_dcr" : "i8080_inr";
+        if (dst == 6) {
+            fprintf(out, "    i8080_wb(c, i8080_get_hl(c), %s(c, %s));\n", fn,
+                MEM_HL);
+        }
+        else {
+            fprintf(out, "    %s = %s(c, %s);\n", REGS[dst], fn, REGS[dst]);
+        }
+    }
+    else if (op >= 0x80 && op <= 0xBF) { // ALU register
+        fprintf(out, "    ");
+        fprintf(out, ALU_OPS[dst], src == 6 ? MEM_HL : REGS[src]);
+        fprintf(out, "\n");
+    }
+    else if ((op & 0xC7) == 0xC6) { // ALU immediate
+        snprintf(operand, sizeof(operand), "0x%02X", byte);
+        fprintf(out, "    ");
+        fprintf(out, ALU_OPS[dst], operand);
+        fprintf(out, "\n");
+    }
+    else if ((op & 0xCF) == 0x01) { // LXI
+        snprintf(operand, sizeof(operand), "0x%04X", word);
+        fprintf(out, "    ");
+        fprintf(out, PAIRS_SET[op >> 4], operand);
+        fprintf(out, "\n");
+    }
+    else if ((op & 0xCF) == 0x09) { // DAD
+        fprintf(out, "    i8080_dad(c, %s);\n", PAIRS_GET[op >> 4]);
+    }
+    else if ((op & 0xCF) == 0x03 || (op & 0xCF) == 0x0B) { // INX, DCX
+        if (op >> 4 == 3) {
+            fprintf(out, "    c->sp %s= 1;\n", (op & 0x08) ? "-" : "+");
+        }
+        else {
+            snprintf(operand, sizeof(operand), "%s %s 1", PAIRS_GET[op >> 4],
+                (op & 0x08) ? "-" : "+");
+            fprintf(out, "    ");
+            fprintf(out, PAIRS_SET[op >> 4], operand);
+            fprintf(out, "\n");
+        }
+    }
+    else if ((op & 0xC7) == 0xC2 || (op & 0xC7) == 0xC4) { // Jcc, Ccc
+        fprintf(out, "    if (%s) {\n", CONDITIONS[dst]);
+        if (op & 0x04) {
+            fprintf(out, "        i8080_push_stack(c, 0x%04X);\n", next);
+            fprintf(out, "        c->cyc += 6;\n");
+        }
+        fprintf(out, "        c->pc = 0x%04X;\n", word);
+        emit_next(out, "        ", word);
+        fprintf(out, "    }\n");
+    }
+    else if ((op & 0xC7) == 0xC0) { // Rcc
+        fprintf(out, "    if (%s) {\n", CONDITIONS[dst]);
+        fprintf(out, "        c->pc = i8080_pop_stack(c);\n");
+        fprintf(out, "        c->cyc += 6;\n");
+        fprintf(out, "        continue;\n");
+        fprintf(out, "    }\n");
+    }
+    else if ((op & 0xC7) == 0xC7) { // RST
+        fprintf(out, "    i8080_push_stack(c, 0x%04X);\n", next);
+        fprintf(out, "    c->pc = 0x%04X;\n", op & 0x38);
+        emit_next(out, "    ", op & 0x38);
+        return;
+    }
+    else {
+        switch (op) {
+        case 0x00: case 0x08: case 0x10: case 0x18:
+        case 0x20: case 0x28: case 0x30: case 0x38: break; // NOPs
+        case 0x02: fprintf(out, "    i8080_wb(c, i8080_get_bc(c), c->a);\n"); break;
+        case 0x12: fprintf(out, "    i8080_wb(c, i8080_get_de(c), c->a);\n"); break;
+        case 0x0A: fprintf(out, "    c->a = i8080_rb(c, i8080_get_bc(c));\n"); break;
+        case 0x1A: fprintf(out, "    c->a = i8080_rb(c, i8080_get_de(c));\n"); break;
+        case 0x22:
+            fprintf(out, "    i8080_ww(c, 0x%04X, i8080_get_hl(c));\n", word);
+            break;
+        case 0x2A:
+            fprintf(out, "    i8080_set_hl(c, i8080_rw(c, 0x%04X));\n", word);
+            break;
+        case 0x32: fprintf(out, "    i8080_wb(c, 0x%04X, c->a);\n", word); break;
+        case 0x3A: fprintf(out, "    c->a = i8080_rb(c, 0x%04X);\n", word); break;
+        case 0x07: fprintf(out, "    i8080_rlc(c);\n"); break;
+        case 0x0F: fprintf(out, "    i8080_rrc(c);\n"); break;
+        case 0x17: fprintf(out, "    i8080_ral(c);\n"); break;
+        case 0x1F: fprintf(out, "    i8080_rar(c);\n"); break;
+        case 0x27: fprintf(out, "    i8080_daa(c);\n"); break;
+        case 0x2F: fprintf(out, "    c->a = ~c->a;\n"); break;
+        case 0x37: fprintf(out, "    c->cf = 1;\n"); break;
+        case 0x3F: fprintf(out, "    c->cf = !c->cf;\n"); break;
+        case 0x76:
+            fprintf(out, "    c->halted = 1;\n");
+            fprintf(out, "    continue;\n");
+            return;
+        case 0xF3: fprintf(out, "    c->iff = 0;\n"); break;
+        case 0xFB:
+            fprintf(out, "    c->iff = 1;\n");
+            fprintf(out, "    c->interrupt_delay = 1;\n");
+            break;
+        case 0xEB: fprintf(out, "    i8080_xchg(c);\n"); break;
+        case 0xE3: fprintf(out, "    i8080_xthl(c);\n"); break;
+        case 0xF9: fprintf(out, "    c->sp = i8080_get_hl(c);\n"); break;
+        case 0xC5: fprintf(out, "    i8080_push_stack(c, i8080_get_bc(c));\n"); break;
+        case 0xD5: fprintf(out, "    i8080_push_stack(c, i8080_get_de(c));\n"); break;
+        case 0xE5: fprintf(out, "    i8080_push_stack(c, i8080_get_hl(c));\n"); break;
+        case 0xF5: fprintf(out, "    i8080_push_psw(c);\n"); break;
+        case 0xC1: fprintf(out, "    i8080_set_bc(c, i8080_pop_stack(c));\n"); break;
+        case 0xD1: fprintf(out, "    i8080_set_de(c, i8080_pop_stack(c));\n"); break;
+        case 0xE1: fprintf(out, "    i8080_set_hl(c, i8080_pop_stack(c));\n"); break;
+        case 0xF1: fprintf(out, "    i8080_pop_psw(c);\n"); break;
+        case 0xDB:
+            fprintf(out, "    c->a = i8080_in(c, "
+                "STAT_PORT(c->stats.ports_in, 0x%02X));\n", byte);
+            break;
+        case 0xD3:
+            fprintf(out, "    i8080_out(c, "
+                "STAT_PORT(c->stats.ports_out, 0x%02X), c->a);\n", byte);
+            break;
+        case 0xE9: // PCHL
+            fprintf(out, "    c->pc = i8080_get_hl(c);\n");
+            fprintf(out, "    continue;\n");
+            return;
+        case 0xC9: case 0xD9: // RET
+            fprintf(out, "    c->pc = i8080_pop_stack(c);\n");
+            fprintf(out, "    continue;\n");
+            return;
+        case 0xC3: case 0xCB: // JMP
+            fprintf(out, "    c->pc = 0x%04X;\n", word);
+            emit_next(out, "    ", word);
+            return;
+        case 0xCD: case 0xDD: case 0xED: case 0xFD: // CALL
+            fprintf(out, "    i8080_push_stack(c, 0x%04X);\n", next);
+            fprintf(out, "    c->pc = 0x%04X;\n", word);
+            emit_next(out, "    ", word);
+            return;
+        }
+    }
+
+    emit_next(out, "    ", next);
+}
+
+static void emit(FILE* out, const char* name, const char* rom_names) {
+    fprintf(out, "// generated by emu8080_recomp from %s, do not edit\n\n",
+        rom_names);
+    fprintf(out, "#include \"emu8080_ops.h\"\n");
+    fprintf(out, "#include \"emu8080_hooks.h\"\n\n");
+    fprintf(out, "// interrupt_delay countdown done before each instruction\n");
+    fprintf(out, "#define DELAY() \\\n");
+    fprintf(out, "  if (c->interrupt_delay > 0) c->interrupt_delay -= 1\n\n");
+    fprintf(out, "// leaves the translated code at the end of the slice or "
+                 "when an interrupt\n// has to be serviced\n");
+    fprintf(out, "#define STOP() \\\n");
+    fprintf(out, "  ((long)(until - c->cyc) <= 0 || \\\n");
+    fprintf(out, "    (c->interrupt_pending && c->iff && "
+                 "c->interrupt_delay == 0))\n\n");
+
+    fprintf(out, "void %s_run(i8080* const c, unsigned long until) {\n", name);
+    fprintf(out, "    while ((long)(until - c->cyc) > 0) {\n");
+    fprintf(out, "        // a write log needs the instruction addresses kept by "
+                 "i8080_step\n");
+    fprintf(out, "        // hooked routines are run by i8080_step\n");
+    fprintf(out, "        if (c->halted || c->write_log != NULL || "
+                 "STOP() ||\n            (c->hooks != NULL && "
+                 "i8080_hooks_find(c->hooks, c->pc) != NULL)) {\n");
+    fprintf(out, "            if (c->halted && !(c->interrupt_pending && "
+                 "c->iff &&\n                c->interrupt_delay == 0)) {\n");
+    fprintf(out, "                return;\n");
+    fprintf(out, "            }\n");
+    fprintf(out, "            i8080_step(c);\n");
+    fprintf(out, "            continue;\n");
+    fprintf(out, "        }\n\n");
+    fprintf(out, "        switch (c->pc) {\n");
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (is_start[addr]) {
+            fprintf(out, "        case 0x%04X: goto L_%04X;\n", addr, addr);
+        }
+    }
+    fprintf(out, "        default: i8080_step(c); continue;\n");
+    fprintf(out, "        }\n\n");
+
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (is_start[addr]) {
+            emit_instruction(out, (uint16_t)addr);
+        }
+    }
+
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n\n");
+    fprintf(out, "#undef DELAY\n#undef STOP\n");
+}
+
+int main(int argc, char** argv) {
+    const char* output = "rom_aot.c";
+    const char* name = "rom";
+    unsigned long load_addr = 0;
+    unsigned long entries[MAX_ENTRIES];
+    int nb_entries = 0;
+    char rom_names[512] = "";
+    unsigned long addr = 0;
+    bool loaded = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            load_addr = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            if (nb_entries < MAX_ENTRIES) {
+                entries[nb_entries++] = strtoul(argv[++i], NULL, 0);
+            }
+        }
+        else {
+            if (!loaded) {
+                addr = load_addr;
+                loaded = true;
+            }
+
+            FILE* f = i8080_open_file(argv[i], "rb");
+            if (f == NULL) {
+                fprintf(stderr, "error: can't open file '%s'.\n", argv[i]);
+                return 1;
+            }
+            int ch;
+            while ((ch = fgetc(f)) != EOF) {
+                if (addr >= MEMORY_SIZE) {
+                    fprintf(stderr, "error: file %s can't fit in memory.\n",
+                        argv[i]);
+                    fclose(f);
+                    return 1;
+                }
+                rom[addr] = (uint8_t)ch;
+                in_rom[addr] = true;
+                addr++;
+            }
+            fclose(f);
+
+            size_t len = strlen(rom_names);
+            if (len + strlen(argv[i]) + 2 < sizeof(rom_names)) {
+                snprintf(rom_names + len, sizeof(rom_names) - len, "%s%s",
+                    len > 0 ? " " : "", argv[i]);
+            }
+        }
+    }
+
+    if (!loaded) {
+        fprintf(stderr, "usage: %s [-o output.c] [-n name] [-a load_addr] "
+                        "[-e entry]... rom_file...\n", argv[0]);
+        return 1;
+    }
+
+    if (nb_entries == 0) {
+        for (int rst = 0; rst < 8; rst++) {
+            entries[nb_entries++] = rst * 8;
+        }
+    }
+    for (int i = 0; i < nb_entries; i++) {
+        discover((uint16_t)entries[i]);
+    }
+
+    FILE* out = i8080_open_file(output, "w");
+    if (out == NULL) {
+        fprintf(stderr, "error: can't open file '%s'.\n", output);
+        return 1;
+    }
+    emit(out, name, rom_names);
+    fclose(out);
+
+    int nb_instructions = 0;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        nb_instructions += is_start[i];
+    }
+    printf("%d instructions translated to %s\n", nb_instructions, output);
+    return 0;
+}
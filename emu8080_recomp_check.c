@@ -0,0 +1,170 @@
+// Checks the code generated by emu8080_recomp against the interpreter: the
+// ROM is run twice from reset, by a loop of i8080_step and by the translated
+// function, and the registers, flags, cycle count and memory (and, built with
+// I8080_STATS, the counters) are compared after every slice.
+//
+// usage: emu8080_recomp -o rom_aot.c [-a load_addr] rom_file...
+//        emu8080_recomp_check [-a load_addr] [-s slice] [-n slices] rom_file...
+//
+// the checker being built with rom_aot.c (the default name "rom" of the
+// recompiler), emu8080.c, emu8080_writelog.c and emu8080_hooks.c; the
+// 8080recomp_check project does it for the Space Invaders ROM. An interrupt
+// is requested after each slice of `slice` cycles (default 16667), RST 1 and
+// RST 2 alternately like on the Space Invaders hardware. Writes to the ROM
+// are ignored and the ports read 0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080.h"
+#include "emu8080_file.h"
+
+#define MEMORY_SIZE 0x10000
+
+void rom_run(i8080* const c, unsigned long until);
+
+typedef struct machine {
+    uint8_t memory[MEMORY_SIZE];
+} machine;
+
+static bool in_rom[MEMORY_SIZE];
+
+static uint8_t rb(void* userdata, uint16_t addr) {
+    return ((machine*)userdata)->memory[addr];
+}
+
+static void wb(void* userdata, uint16_t addr, uint8_t val) {
+    if (!in_rom[addr]) {
+        ((machine*)userdata)->memory[addr] = val;
+    }
+}
+
+static uint8_t port_in(void* userdata, uint8_t port) {
+    return 0x00;
+}
+
+static void port_out(void* userdata, uint8_t port, uint8_t value) {
+}
+
+static void setup(i8080* const c, machine* const m) {
+    i8080_init(c);
+    c->userdata = m;
+    c->read_byte = rb;
+    c->write_byte = wb;
+    c->port_in = port_in;
+    c->port_out = port_out;
+}
+
+// runs the interpreter until `until` cycles, stopping like the translated
+// code when the cpu is halted with no interrupt to service
+static void step_run(i8080* const c, unsigned long until) {
+    while ((long)(until - c->cyc) > 0) {
+        if (c->halted && !(c->interrupt_pending && c->iff &&
+            c->interrupt_delay == 0)) {
+            return;
+        }
+        i8080_step(c);
+    }
+}
+
+// a halted cpu waits for the end of the slice
+static void end_slice(i8080* const c, unsigned long until) {
+    if (c->halted && (long)(until - c->cyc) > 0) {
+        c->cyc = until;
+    }
+}
+
+static bool same_state(const i8080* const a, const i8080* const b) {
+    return a->pc == b->pc && a->sp == b->sp && a->a == b->a && a->b == b->b &&
+        a->c == b->c && a->d == b->d && a->e == b->e && a->h == b->h &&
+        a->l == b->l && a->sf == b->sf && a->zf == b->zf && a->hf == b->hf &&
+        a->pf == b->pf && a->cf == b->cf && a->iff == b->iff &&
+        a->halted == b->halted && a->cyc == b->cyc &&
+        a->interrupt_pending == b->interrupt_pending &&
+        a->interrupt_delay == b->interrupt_delay;
+}
+
+int main(int argc, char** argv) {
+    static machine interpreted, translated;
+    unsigned long load_addr = 0;
+    unsigned long slice = 16667;
+    unsigned long nb_slices = 6000;
+    unsigned long addr = 0;
+    bool loaded = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            load_addr = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            slice = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nb_slices = strtoul(argv[++i], NULL, 0);
+        }
+        else {
+            if (!loaded) {
+                addr = load_addr;
+                loaded = true;
+            }
+
+            FILE* f = i8080_open_file(argv[i], "rb");
+            if (f == NULL) {
+                fprintf(stderr, "error: can't open file '%s'.\n", argv[i]);
+                return 1;
+            }
+            int ch;
+            while ((ch = fgetc(f)) != EOF) {
+                if (addr >= MEMORY_SIZE) {
+                    fprintf(stderr, "error: file %s can't fit in memory.\n",
+                        argv[i]);
+                    fclose(f);
+                    return 1;
+                }
+                interpreted.memory[addr] = (uint8_t)ch;
+                in_rom[addr] = true;
+                addr++;
+            }
+            fclose(f);
+        }
+    }
+
+    if (!loaded || slice == 0) {
+        fprintf(stderr, "usage: %s [-a load_addr] [-s slice] [-n slices] "
+                        "rom_file...\n", argv[0]);
+        return 1;
+    }
+
+    translated = interpreted;
+    i8080 a, b;
+    setup(&a, &interpreted);
+    setup(&b, &translated);
+
+    for (unsigned long i = 0; i < nb_slices; i++) {
+        unsigned long until = (i + 1) * slice;
+        step_run(&a, until);
+        end_slice(&a, until);
+        rom_run(&b, until);
+        end_slice(&b, until);
+
+        bool same_stats = true;
+#ifdef I8080_STATS
+        same_stats = memcmp(&a.stats, &b.stats, sizeof(a.stats)) == 0;
+#endif
+        if (!same_state(&a, &b) || !same_stats ||
+            memcmp(interpreted.memory, translated.memory, MEMORY_SIZE) != 0) {
+            printf("slice %lu: the translated code differs (pc %04X/%04X, "
+                "cyc %lu/%lu, counters %s)\n", i, a.pc, b.pc, a.cyc, b.cyc,
+                same_stats ? "equal" : "differ");
+            return 1;
+        }
+
+        i8080_interrupt(&a, i % 2 == 0 ? 0xCF : 0xD7);
+        i8080_interrupt(&b, i % 2 == 0 ? 0xCF : 0xD7);
+    }
+
+    printf("%lu slices of %lu cycles, same state\n", nb_slices, slice);
+    return 0;
+}
+
+#undef MEMORY_SIZE
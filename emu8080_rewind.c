@@ -0,0 +1,345 @@
+// Rewind buffer: periodic keyframes of the whole machine, and between them
+// compressed diffs of the pages written (tracked by the cpu in
+// `dirty_pages`). Seeking restores the closest point before the target cycle
+// and re-executes forward from there.
+//
+// note: memory is read and restored through the `read_byte` and `write_byte`
+// callbacks, so writes done by the host directly to its memory (and not
+// through the cpu) are only picked up by the next keyframe.
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080_rewind.h"
+#include "emu8080_writelog.h"
+
+#define MEMORY_SIZE 0x10000
+#define PAGE_SIZE 0x100
+
+static void default_step(i8080* c, void* userdata) {
+    i8080_step(c);
+}
+
+// initialises an empty rewind buffer
+bool i8080_rewind_init(
+    i8080_rewind* const r, size_t budget, unsigned keyframe_interval) {
+    memset(r, 0, sizeof(*r));
+    r->budget = budget;
+    r->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    r->clock_hz = 2000000;
+    r->step = default_step;
+
+    r->shadow = malloc(MEMORY_SIZE);
+    return r->shadow != NULL;
+}
+
+// drops the `n` oldest points
+static void drop_front(i8080_rewind* const r, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        r->bytes -= sizeof(i8080_rewind_point) + r->points[i].size;
+        free(r->points[i].data);
+    }
+    memmove(r->points, r->points + n, (r->count - n) * sizeof(*r->points));
+    r->count -= n;
+}
+
+// drops every point after index `last`
+static void drop_back(i8080_rewind* const r, size_t last) {
+    while (r->count > last + 1) {
+        r->count -= 1;
+        r->bytes -= sizeof(i8080_rewind_point) + r->points[r->count].size;
+        free(r->points[r->count].data);
+    }
+}
+
+void i8080_rewind_free(i8080_rewind* const r) {
+    drop_front(r, r->count);
+    free(r->points);
+    free(r->shadow);
+    r->points = NULL;
+    r->shadow = NULL;
+    r->capacity = 0;
+}
+
+// evicts the oldest keyframe (and its deltas) while over budget, always
+// keeping the most recent keyframe (when it is the only one left, the next
+// capture is a keyframe, see i8080_rewind_capture)
+static void evict(i8080_rewind* const r) {
+    while (r->bytes > r->budget) {
+        size_t next = 1;
+        while (next < r->count && !r->points[next].keyframe) {
+            next++;
+        }
+        if (next >= r->count) {
+            return;
+        }
+        drop_front(r, next);
+    }
+}
+
+// run-length encodes the xor of `page` and `prev` into `out` as a sequence
+// of (nb zero bytes, nb literal bytes, literal bytes...), returns the number
+// of bytes written (0 if the page did not change)
+static size_t encode_page(
+    const uint8_t* page, const uint8_t* prev, uint8_t* out) {
+    size_t len = 0;
+    bool changed = false;
+    int i = 0;
+
+    while (i < PAGE_SIZE) {
+        int zeros = 0;
+        while (i < PAGE_SIZE && zeros < 255 && page[i] == prev[i]) {
+            zeros++;
+            i++;
+        }
+
+        int nb_lit = 0;
+        size_t lit_pos = len + 1;
+        while (i + nb_lit < PAGE_SIZE && nb_lit < 255 &&
+            page[i + nb_lit] != prev[i + nb_lit]) {
+            out[lit_pos + 1 + nb_lit] = page[i + nb_lit] ^ prev[i + nb_lit];
+            nb_lit++;
+        }
+
+        out[len] = zeros;
+        out[lit_pos] = nb_lit;
+        len = lit_pos + 1 + nb_lit;
+        i += nb_lit;
+        changed |= nb_lit > 0;
+    }
+
+    return changed ? len : 0;
+}
+
+// applies an encoded page on top of `page`, returns the number of encoded
+// bytes consumed
+static size_t decode_page(const uint8_t* in, uint8_t* page) {
+    size_t pos = 0;
+    int i = 0;
+
+    while (i < PAGE_SIZE) {
+        i += in[pos++];
+        int nb_lit = in[pos++];
+        for (int j = 0; j < nb_lit; j++) {
+            page[i++] ^= in[pos++];
+        }
+    }
+
+    return pos;
+}
+
+// encodes the pages written since the last capture. Each page is stored as
+// (page number, encoded length (2 bytes, little endian), encoded page).
+static uint8_t* encode_delta(
+    i8080_rewind* const r, i8080* const c, size_t* size) {
+    // worst case: a changed byte every other byte costs 3 bytes per 2 bytes
+    uint8_t* out = malloc(256 * (3 + 2 * PAGE_SIZE));
+    uint8_t page[PAGE_SIZE];
+    size_t len = 0;
+
+    if (out == NULL) {
+        return NULL;
+    }
+
+    for (int p = 0; p < 256; p++) {
+        if (!(c->dirty_pages[p >> 5] & (1u << (p & 31)))) {
+            continue;
+        }
+
+        uint8_t* prev = &r->shadow[p * PAGE_SIZE];
+        for (int i = 0; i < PAGE_SIZE; i++) {
+            page[i] = c->read_byte(c->userdata, p * PAGE_SIZE + i);
+        }
+
+        size_t page_len = encode_page(page, prev, &out[len + 3]);
+        if (page_len > 0) {
+            out[len] = p;
+            out[len + 1] = page_len & 0xFF;
+            out[len + 2] = page_len >> 8;
+            len += 3 + page_len;
+            memcpy(prev, page, PAGE_SIZE);
+        }
+    }
+
+    *size = len;
+    return realloc(out, len > 0 ? len : 1);
+}
+
+static void save_cpu(i8080_rewind_cpu* const s, const i8080* const c) {
+    s->cyc = c->cyc;
+    s->pc = c->pc;
+    s->sp = c->sp;
+    s->a = c->a;
+    s->b = c->b;
+    s->c = c->c;
+    s->d = c->d;
+    s->e = c->e;
+    s->h = c->h;
+    s->l = c->l;
+    s->sf = c->sf;
+    s->zf = c->zf;
+    s->hf = c->hf;
+    s->pf = c->pf;
+    s->cf = c->cf;
+    s->iff = c->iff;
+    s->halted = c->halted;
+    s->interrupt_pending = c->interrupt_pending;
+    s->interrupt_vector = c->interrupt_vector;
+    s->interrupt_delay = c->interrupt_delay;
+#ifdef I8080_STATS
+    s->interrupt_request_cyc = c->interrupt_request_cyc;
+#endif
+}
+
+static void restore_cpu(i8080* const c, const i8080_rewind_cpu* const s) {
+    c->cyc = s->cyc;
+    c->pc = s->pc;
+    c->sp = s->sp;
+    c->a = s->a;
+    c->b = s->b;
+    c->c = s->c;
+    c->d = s->d;
+    c->e = s->e;
+    c->h = s->h;
+    c->l = s->l;
+    c->sf = s->sf;
+    c->zf = s->zf;
+    c->hf = s->hf;
+    c->pf = s->pf;
+    c->cf = s->cf;
+    c->iff = s->iff;
+    c->halted = s->halted;
+    c->interrupt_pending = s->interrupt_pending;
+    c->interrupt_vector = s->interrupt_vector;
+    c->interrupt_delay = s->interrupt_delay;
+#ifdef I8080_STATS
+    c->interrupt_request_cyc = s->interrupt_request_cyc;
+#endif
+}
+
+// stores the current state of the machine. Call it at a regular pace
+// (e.g. once per frame).
+bool i8080_rewind_capture(i8080_rewind* const r, i8080* const c) {
+    if (r->count == r->capacity) {
+        size_t capacity = r->capacity > 0 ? r->capacity * 2 : 64;
+        i8080_rewind_point* points =
+            realloc(r->points, capacity * sizeof(*points));
+        if (points == NULL) {
+            return false;
+        }
+        r->points = points;
+        r->capacity = capacity;
+    }
+
+    i8080_rewind_point* const p = &r->points[r->count];
+    save_cpu(&p->cpu, c);
+    // over budget, only a new keyframe lets the oldest group be evicted
+    p->keyframe = r->count == 0 || r->since_keyframe >= r->keyframe_interval ||
+        r->bytes > r->budget;
+
+    if (p->keyframe) {
+        p->size = MEMORY_SIZE;
+        p->data = malloc(MEMORY_SIZE);
+        if (p->data == NULL) {
+            return false;
+        }
+        for (int i = 0; i < MEMORY_SIZE; i++) {
+            p->data[i] = c->read_byte(c->userdata, i);
+        }
+        memcpy(r->shadow, p->data, MEMORY_SIZE);
+        r->since_keyframe = 0;
+    }
+    else {
+        p->data = encode_delta(r, c, &p->size);
+        if (p->data == NULL) {
+            return false;
+        }
+    }
+
+    memset(c->dirty_pages, 0, sizeof(c->dirty_pages));
+    r->since_keyframe += 1;
+    r->count += 1;
+    r->bytes += sizeof(*p) + p->size;
+    evict(r);
+    return true;
+}
+
+// rewinds the machine to cycle `cyc`: restores the closest point at or before
+// `cyc`, then re-executes forward until `cyc` is reached. Points after the
+// restored one are discarded. Returns false if `cyc` is older than the
+// oldest point stored.
+bool i8080_rewind_seek(
+    i8080_rewind* const r, i8080* const c, unsigned long cyc) {
+    size_t target = r->count;
+    while (target > 0 && (long)(r->points[target - 1].cpu.cyc - cyc) > 0) {
+        target--;
+    }
+    if (target == 0) {
+        return false;
+    }
+    target -= 1;
+
+    size_t key = target;
+    while (!r->points[key].keyframe) {
+        key--;
+    }
+
+    // rebuild memory from the keyframe and the deltas that follow it
+    memcpy(r->shadow, r->points[key].data, MEMORY_SIZE);
+    for (size_t i = key + 1; i <= target; i++) {
+        const uint8_t* data = r->points[i].data;
+        size_t pos = 0;
+        while (pos < r->points[i].size) {
+            uint8_t page = data[pos];
+            pos += 3;
+            pos += decode_page(&data[pos], &r->shadow[page * PAGE_SIZE]);
+        }
+    }
+
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        c->write_byte(c->userdata, i, r->shadow[i]);
+    }
+
+    // the callbacks, subsystems and counters (they only ever go up) are the
+    // current ones
+    restore_cpu(c, &r->points[target].cpu);
+    memset(c->dirty_pages, 0, sizeof(c->dirty_pages));
+
+    if (c->write_log != NULL) {
+        i8080_writelog_truncate(c->write_log, c->cyc);
+    }
+
+    drop_back(r, target);
+    r->since_keyframe = (unsigned)(target - key + 1);
+
+    // the re-execution stops exactly at `cyc` (no pair fused nor loop
+    // batched past it)
+    const unsigned long next_event = c->next_event;
+    c->next_event = cyc;
+    while ((long)(cyc - c->cyc) > 0) {
+        unsigned long before = c->cyc;
+        r->step(c, r->step_userdata);
+        if (c->cyc == before && c->halted) {
+            break;
+        }
+    }
+    c->next_event = next_event;
+
+    return true;
+}
+
+// returns the average number of bytes stored per emulated second
+double i8080_rewind_bytes_per_second(const i8080_rewind* const r) {
+    if (r->count < 2) {
+        return 0.0;
+    }
+
+    unsigned long span = r->points[r->count - 1].cpu.cyc - r->points[0].cpu.cyc;
+    if (span == 0) {
+        return 0.0;
+    }
+
+    return (double)r->bytes * r->clock_hz / span;
+}
+
+#undef MEMORY_SIZE
+#undef PAGE_SIZE
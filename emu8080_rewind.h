@@ -0,0 +1,59 @@
+#ifndef I8080_REWIND_H_
+#define I8080_REWIND_H_
+
+#include <stddef.h>
+#include "emu8080.h"
+
+// the cpu state kept by a point: registers, flags, cycle count and interrupt
+// state (not the callbacks, the optional subsystems nor the counters)
+typedef struct i8080_rewind_cpu {
+	unsigned long cyc;
+	uint16_t pc, sp;
+	uint8_t a, b, c, d, e, h, l;
+	bool sf, zf, hf, pf, cf, iff, halted;
+	bool interrupt_pending;
+	uint8_t interrupt_vector;
+	uint8_t interrupt_delay;
+#ifdef I8080_STATS
+	unsigned long interrupt_request_cyc;
+#endif
+} i8080_rewind_cpu;
+
+// a point in time the machine can be rewound to. Keyframes hold the whole
+// 64 KiB memory, deltas hold the pages written since the previous point
+// (xor'd against it and run-length encoded).
+typedef struct i8080_rewind_point {
+	i8080_rewind_cpu cpu; // cpu state at capture time
+	bool keyframe;
+	size_t size; // size of `data` in bytes
+	uint8_t* data;
+} i8080_rewind_point;
+
+typedef struct i8080_rewind {
+	size_t budget; // max number of bytes stored (points + data)
+	unsigned keyframe_interval; // number of captures between two keyframes
+	unsigned long clock_hz; // emulated clock, used for the bytes/second report
+
+	// step function used to re-execute forward after a seek (defaults to
+	// i8080_step, set it if the host fires interrupts from its own loop).
+	// The re-execution goes through the live `port_in`/`port_out` (and port
+	// handlers) again: inputs are not recorded, so a host whose ports are not
+	// deterministic must replay them itself from this function.
+	void (*step)(i8080*, void*);
+	void* step_userdata;
+
+	i8080_rewind_point* points; // oldest first
+	size_t count, capacity;
+	size_t bytes; // bytes currently stored
+	unsigned since_keyframe; // captures since the last keyframe
+	uint8_t* shadow; // memory as of the last capture
+} i8080_rewind;
+
+bool i8080_rewind_init(i8080_rewind* const r, size_t budget,
+	unsigned keyframe_interval);
+void i8080_rewind_free(i8080_rewind* const r);
+bool i8080_rewind_capture(i8080_rewind* const r, i8080* const c);
+bool i8080_rewind_seek(i8080_rewind* const r, i8080* const c, unsigned long cyc);
+double i8080_rewind_bytes_per_second(const i8080_rewind* const r);
+
+#endif // I8080_REWIND_H_
@@ -1,16 +1,24 @@
 // This file uses the 8080 emulator to run the test suite (roms in cpu_tests
-// directory). It uses a simple array as memory.
+// directory), then the unit tests of the optional subsystems, and with
+// --bench the device benchmark. It uses a simple array as memory.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "emu8080.h"
+#include "emu8080_checkpoint.h"
+#include "emu8080_cpm.h"
+#include "emu8080_devices.h"
+#include "emu8080_file.h"
+#include "emu8080_hooks.h"
+#include "emu8080_io.h"
+#include "emu8080_rewind.h"
+#include "emu8080_writelog.h"
 
 // memory callbacks
 #define MEMORY_SIZE 0x10000
 static uint8_t* memory = NULL;
-static bool test_finished = 0;
 
 static uint8_t rb(void* userdata, uint16_t addr) {
     return memory[addr];
@@ -25,101 +33,942 @@ static uint8_t port_in(void* userdata, uint8_t port) {
 }
 
 static void port_out(void* userdata, uint8_t port, uint8_t value) {
-    i8080* const c = (i8080*)userdata;
+}
+
+// initialises a cpu using the callbacks above
+static void setup_cpu(i8080* const c) {
+    i8080_init(c);
+    c->userdata = c;
+    c->read_byte = rb;
+    c->write_byte = wb;
+    c->port_in = port_in;
+    c->port_out = port_out;
+}
+
+// tests failed (a test rom ending on another cycle count than expected is
+// one)
+static int nb_failures = 0;
+
+// returns true if a file exists but is empty (a placeholder test rom)
+static bool is_empty_file(const char* filename) {
+    FILE* f = i8080_open_file(filename, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    bool empty = fgetc(f) == EOF;
+    fclose(f);
+    return empty;
+}
+
+static inline void run_test(
+    i8080* const c, const char* filename, unsigned long cyc_expected) {
+    setup_cpu(c);
+    memset(memory, 0, MEMORY_SIZE);
+
+    if (is_empty_file(filename)) {
+        printf("*** TEST: %s: skipped (empty file)\n\n", filename);
+        return;
+    }
+
+    // the tests print through the BDOS (CALL 5) and end with a warm boot
+    // (JMP 0), both done by the CP/M layer
+    i8080_cpm cpm;
+    i8080_cpm_init(&cpm, c, memory);
+    cpm.bdos_cycles = 20; // cost of an "out 1,a; ret" BDOS stub
+
+    if (!i8080_cpm_load(&cpm, filename, NULL)) {
+        nb_failures += 1;
+        return;
+    }
+    printf("*** TEST: %s\n", filename);
+
+    long nb_instructions = 0;
+
+    while (i8080_cpm_step(&cpm, c)) {
+        nb_instructions += 1;
+
+        // uncomment following line to have a debug output of machine state
+        // warning: will output multiple GB of data for the whole test suite
+        // i8080_debug_output(c, false);
+    }
+    i8080_cpm_close(&cpm);
+
+    long long diff = cyc_expected - c->cyc;
+    printf("\n*** %lu instructions executed on %lu cycles"
+        " (expected=%lu, diff=%lld)\n\n",
+        nb_instructions, c->cyc, cyc_expected, diff);
+    nb_failures += diff != 0;
+}
+
+// device benchmark: the space invaders rom run with its two screen
+// interrupts and a watchdog counting the writes on port 6, first as
+// callbacks polled after each instruction, then as scheduler devices
+#define HALF_FRAME_CYCLES 16667
+#define BENCH_FRAMES 20000
+
+static unsigned long watchdog_writes = 0;
+
+static bool load_invaders(void) {
+    const char* files[4] = { "invaders.h", "invaders.g", "invaders.f",
+        "invaders.e" };
+
+    memset(memory, 0, MEMORY_SIZE);
+    for (int i = 0; i < 4; i++) {
+        FILE* f = i8080_open_file(files[i], "rb");
+        if (f == NULL) {
+            fprintf(stderr, "error: can't open file '%s'.\n", files[i]);
+            return false;
+        }
+        fread(&memory[i * 0x800], 1, 0x800, f);
+        fclose(f);
+    }
+    return true;
+}
+
+static void bench_init(i8080* const c) {
+    setup_cpu(c);
+    watchdog_writes = 0;
+}
+
+static void callback_port_out(void* userdata, uint8_t port, uint8_t value) {
+    if (port == 6) {
+        watchdog_writes += 1;
+    }
+}
+
+static void vblank(i8080_device* d, i8080* c) {
+    I8080_DEVICE_BEGIN(d);
+    for (;;) {
+        I8080_DEVICE_WAIT_CYCLES(d, HALF_FRAME_CYCLES);
+        i8080_interrupt(c, 0xCF); // RST 1, mid-screen
+        I8080_DEVICE_WAIT_CYCLES(d, HALF_FRAME_CYCLES);
+        i8080_interrupt(c, 0xD7); // RST 2, vblank
+    }
+    I8080_DEVICE_END(d);
+}
+
+static void watchdog(i8080_device* d, i8080* c) {
+    I8080_DEVICE_BEGIN(d);
+    for (;;) {
+        I8080_DEVICE_WAIT_PORT(d, 6);
+        watchdog_writes += 1;
+    }
+    I8080_DEVICE_END(d);
+}
 
-    if (port == 0) {
-        test_finished = 1;
+static void run_device_benchmark(i8080* const c) {
+    const unsigned long until = BENCH_FRAMES * 2UL * HALF_FRAME_CYCLES;
+
+    if (!load_invaders()) {
+        return;
     }
-    else if (port == 1) {
-        uint8_t operation = c->c;
+    printf("*** BENCHMARK: devices, %d frames of invaders\n", BENCH_FRAMES);
 
-        if (operation == 2) { // print a character stored in E
-            printf("%c", c->e);
+    // callbacks: the cycle counter is polled after each instruction
+    bench_init(c);
+    c->port_out = callback_port_out;
+    unsigned long next_interrupt = HALF_FRAME_CYCLES;
+    uint8_t vector = 0xCF;
+    clock_t start = clock();
+    while ((long)(until - c->cyc) > 0) {
+        if (c->halted && !(c->interrupt_pending && c->iff)) {
+            c->cyc = next_interrupt;
         }
-        else if (operation == 9) { // print from memory at (DE) until '$' char
-            uint16_t addr = (c->d << 8) | c->e;
-            do {
-                printf("%c", rb(c, addr++));
-            } while (rb(c, addr) != '$');
+        else {
+            i8080_step(c);
+        }
+        if ((long)(c->cyc - next_interrupt) >= 0) {
+            i8080_interrupt(c, vector);
+            vector ^= 0xCF ^ 0xD7;
+            next_interrupt += HALF_FRAME_CYCLES;
         }
     }
+    double callback_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+    unsigned long callback_cyc = c->cyc;
+    unsigned long callback_writes = watchdog_writes;
+
+    // devices: resumed by the scheduler at their wake-up cycles
+    if (!load_invaders()) {
+        return;
+    }
+    bench_init(c);
+    i8080_port ports[256] = { 0 };
+    c->ports = ports;
+    i8080_scheduler s;
+    i8080_scheduler_init(&s, ports);
+    i8080_device devices[2] = { { .run = vblank }, { .run = watchdog } };
+    i8080_scheduler_add(&s, &devices[0], c);
+    i8080_scheduler_add(&s, &devices[1], c);
+    start = clock();
+    i8080_scheduler_run(&s, c, until);
+    double device_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("*** callbacks: %.3fs, devices: %.3fs (cycles %lu/%lu, "
+        "watchdog writes %lu/%lu)\n\n", callback_time, device_time,
+        callback_cyc, c->cyc, callback_writes, watchdog_writes);
 }
 
-static inline int load_file(const char* filename, uint16_t addr) {
-    FILE* f;
-    errno_t err_code = fopen_s(&f, filename, "w+");
-    if (err_code != 0) {
-        fprintf(stderr, "error: can't open file '%s'.\n", filename);
-        return 1;
+#undef HALF_FRAME_CYCLES
+#undef BENCH_FRAMES
+
+// unit tests: each one returns false (after printing the failed check) if it
+// fails
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("*** check failed: %s (line %d)\n", #cond, __LINE__); \
+      return false; \
+    } \
+  } while (0)
+
+static void run_unit_test(const char* name, bool (*test)(void)) {
+    bool passed = test();
+    printf("*** TEST: %s: %s\n", name, passed ? "ok" : "FAILED");
+    nb_failures += !passed;
+}
+
+static bool same_registers(const i8080* const a, const i8080* const b) {
+    return a->pc == b->pc && a->sp == b->sp && a->a == b->a && a->b == b->b &&
+        a->c == b->c && a->d == b->d && a->e == b->e && a->h == b->h &&
+        a->l == b->l && a->sf == b->sf && a->zf == b->zf && a->hf == b->hf &&
+        a->pf == b->pf && a->cf == b->cf && a->iff == b->iff &&
+        a->halted == b->halted && a->cyc == b->cyc;
+}
+
+// fills 0x2000-0x2FFF with a counter, over and over
+static const uint8_t FILL_PROGRAM[] = {
+    0x21, 0x00, 0x20, // LXI H,2000h
+    0x77, // loop: MOV M,A
+    0x23, // INX H
+    0x3C, // INR A
+    0x47, // MOV B,A
+    0x3E, 0x30, // MVI A,30h
+    0xBC, // CMP H
+    0x78, // MOV A,B
+    0xC2, 0x03, 0x00, // JNZ loop
+    0x3C, // INR A
+    0xC3, 0x00, 0x00, // JMP 0
+};
+
+// rewind: a seek lands on the state the machine had at that cycle, and runs
+// forward to the same state again
+static bool test_rewind_round_trip(void) {
+    static uint8_t memory_at_target[MEMORY_SIZE], memory_at_end[MEMORY_SIZE];
+    const unsigned long frame_cycles = 10000;
+    const unsigned long target = 17 * frame_cycles + 1234;
+    i8080 c, at_target, at_end;
+    i8080_rewind r;
+    bool saved = false;
+
+    setup_cpu(&c);
+    at_target = c;
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, FILL_PROGRAM, sizeof(FILL_PROGRAM));
+    CHECK(i8080_rewind_init(&r, 1 << 20, 4));
+
+    for (unsigned long frame = 1; frame <= 40; frame++) {
+        while (c.cyc < frame * frame_cycles) {
+            if (!saved && c.cyc >= target) {
+                at_target = c;
+                memcpy(memory_at_target, memory, MEMORY_SIZE);
+                saved = true;
+            }
+            i8080_step(&c);
+        }
+        CHECK(i8080_rewind_capture(&r, &c));
     }
+    CHECK(saved);
+    at_end = c;
+    memcpy(memory_at_end, memory, MEMORY_SIZE);
 
-    // file size check:
-    fseek(f, 0, SEEK_END);
-    size_t file_size = ftell(f);
-    rewind(f);
+    CHECK(i8080_rewind_seek(&r, &c, target));
+    CHECK(same_registers(&c, &at_target));
+    CHECK(memcmp(memory, memory_at_target, MEMORY_SIZE) == 0);
 
-    if (file_size + addr >= MEMORY_SIZE) {
-        fprintf(stderr, "error: file %s can't fit in memory.\n", filename);
-        return 1;
+    while (c.cyc < at_end.cyc) {
+        i8080_step(&c);
     }
+    CHECK(same_registers(&c, &at_end));
+    CHECK(memcmp(memory, memory_at_end, MEMORY_SIZE) == 0);
 
-    // copying the bytes in memory:
-    size_t result = fread(&memory[addr], sizeof(uint8_t), file_size, f);
-    if (result != file_size) {
-        fprintf(stderr, "error: while reading file '%s'\n", filename);
-        return 1;
+    // older than the oldest point
+    CHECK(!i8080_rewind_seek(&r, &c, 0));
+    i8080_rewind_free(&r);
+    return true;
+}
+
+// io: a press and a release pushed between two reads are both read, and
+// the latency of each value read is recorded
+static bool test_io_input_one_value_per_read(void) {
+    static const uint8_t program[] = {
+        0xDB, 0x01, // IN 1
+        0x47, // MOV B,A
+        0xDB, 0x01, // IN 1
+        0x4F, // MOV C,A
+        0xDB, 0x01, // IN 1
+        0x57, // MOV D,A
+        0x76, // HLT
+    };
+    i8080 c;
+    i8080_port ports[256] = { 0 };
+    i8080_io_input in;
+
+    setup_cpu(&c);
+    c.ports = ports;
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, program, sizeof(program));
+    CHECK(i8080_io_input_init(&in, 16));
+    i8080_io_input_attach(&in, ports, 1);
+
+    CHECK(i8080_io_input_push(&in, 1, 0x01)); // pressed
+    CHECK(i8080_io_input_push(&in, 1, 0x00)); // released
+    while (!c.halted) {
+        i8080_step(&c);
+    }
+    CHECK(c.b == 0x01 && c.c == 0x00 && c.d == 0x00);
+    CHECK(in.latency.count == 2 && in.dropped == 0);
+
+    FILE* report = i8080_open_file("io_latency.tmp", "w+b");
+    if (report != NULL) {
+        i8080_io_latency_export(&in.latency, report);
+        CHECK(ftell(report) > 0);
+        fclose(report);
+        remove("io_latency.tmp");
+    }
+    i8080_io_input_free(&in);
+    return true;
+}
+
+// a loop of the fused pairs (one of them overwriting its own second opcode),
+// interrupted every 1000 cycles, starting at 0x40
+static const uint8_t FUSION_PROGRAM[] = {
+    0x31, 0x00, 0x30, // LXI SP,3000h
+    0xFB, // EI
+    0x21, 0x00, 0x20, // loop: LXI H,2000h
+    0x0E, 0x20, // MVI C,20h
+    0x7E, // inner: MOV A,M
+    0x23, // INX H
+    0x3C, // INR A
+    0x77, // MOV M,A
+    0x23, // INX H
+    0x0D, // DCR C
+    0xC2, 0x49, 0x00, // JNZ inner
+    0x11, 0x00, 0x20, // LXI D,2000h
+    0x01, 0x00, 0x24, // LXI B,2400h
+    0x1A, // LDAX D
+    0x02, // STAX B
+    0x21, 0x60, 0x00, // LXI H,next
+    0x3E, 0x2B, // MVI A,2Bh (DCX H)
+    0x77, // MOV M,A
+    0x23, // next: INX H, replaced by DCX H
+    0x7D, // MOV A,L
+    0x32, 0x00, 0x23, // STA 2300h
+    0x3E, 0x23, // MVI A,23h
+    0x32, 0x60, 0x00, // STA next
+    0x3A, 0x00, 0x20, // LDA 2000h
+    0xFE, 0x80, // CPI 80h
+    0xDA, 0x44, 0x00, // JC loop
+    0xC3, 0x44, 0x00, // JMP loop
+};
+
+// runs FUSION_PROGRAM for 200 interrupts, fused or not
+static void run_fusion_program(i8080* const c, i8080_fusion* const f) {
+    setup_cpu(c);
+    c->fusion = f;
+    memset(memory, 0, MEMORY_SIZE);
+    memory[0x0000] = 0xC3; // JMP 40h
+    memory[0x0001] = 0x40;
+    memory[0x0008] = 0xFB; // RST 1: EI
+    memory[0x0009] = 0xC9; // RET
+    memcpy(memory + 0x40, FUSION_PROGRAM, sizeof(FUSION_PROGRAM));
+
+    for (unsigned long i = 1; i <= 200; i++) {
+        c->next_event = i * 1000;
+        while (c->cyc < i * 1000) {
+            i8080_step(c);
+        }
+        i8080_interrupt(c, 0xCF);
+    }
+}
+
+// fusion: the fused pairs give the same state, memory and counters as the
+// opcodes executed one by one
+static bool test_fusion_differential(void) {
+    static uint8_t unfused_memory[MEMORY_SIZE];
+    static i8080_fusion f;
+    i8080 unfused, fused;
+
+    run_fusion_program(&unfused, NULL);
+    memcpy(unfused_memory, memory, MEMORY_SIZE);
+
+    i8080_fusion_init(&f);
+    i8080_fusion_enable(&f, 0x7E, 0x23); // MOV A,M / INX H
+    i8080_fusion_enable(&f, 0x77, 0x23); // MOV M,A / INX H
+    i8080_fusion_enable(&f, 0x0D, 0xC2); // DCR C / JNZ
+    i8080_fusion_enable(&f, 0x1A, 0x02); // LDAX D / STAX B
+    i8080_fusion_enable(&f, 0xFE, 0xDA); // CPI / JC
+    run_fusion_program(&fused, &f);
+
+    CHECK(f.fused > 0 && f.split > 0);
+    CHECK(same_registers(&unfused, &fused));
+    CHECK(memcmp(unfused_memory, memory, MEMORY_SIZE) == 0);
+#ifdef I8080_STATS
+    // each split pair read its second opcode twice
+    unsigned long long unfused_reads = 0, fused_reads = 0;
+    for (int i = 0; i < 256; i++) {
+        unfused_reads += unfused.stats.reads[i];
+        fused_reads += fused.stats.reads[i];
+        CHECK(unfused.stats.writes[i] == fused.stats.writes[i]);
+    }
+    CHECK(fused_reads == unfused_reads + f.split);
+    CHECK(unfused.stats.instructions == fused.stats.instructions);
+#endif
+    return true;
+}
+
+// runs the cpu until 40000 cycles, ticking a checkpoint after each step. Returns false if it stopped early.
+static bool run_checkpointed(i8080_checkpoint* const ck, i8080* const c) {
+    while (c->cyc < 40000) {
+        i8080_step(c);
+        if (!i8080_checkpoint_tick(ck, c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// checkpoints: a run recorded unfused compares equal fused, until the end of
+// the recording, and a run changed midway diverges where it was changed
+static bool test_checkpoint_record_compare(void) {
+    static i8080_fusion f;
+    const char* const golden = "checkpoint_golden.tmp";
+    const char* const changed = "checkpoint_changed.tmp";
+    i8080_checkpoint ck;
+    i8080 c;
+
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, FILL_PROGRAM, sizeof(FILL_PROGRAM));
+    CHECK(!i8080_checkpoint_record(&ck, golden, 0, &c));
+    CHECK(i8080_checkpoint_record(&ck, golden, 1000, &c));
+    CHECK(run_checkpointed(&ck, &c));
+    i8080_checkpoint_close(&ck);
+
+    i8080_fusion_init(&f);
+    i8080_fusion_enable(&f, 0x77, 0x23); // MOV M,A / INX H
+    i8080_fusion_enable(&f, 0xBC, 0xC2); // CMP H / JNZ
+    setup_cpu(&c);
+    c.fusion = &f;
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, FILL_PROGRAM, sizeof(FILL_PROGRAM));
+    CHECK(i8080_checkpoint_compare(&ck, golden, &c));
+    CHECK(run_checkpointed(&ck, &c));
+    CHECK(f.fused > 0);
+    CHECK(ck.index == 40);
+    while (i8080_checkpoint_tick(&ck, &c)) {
+        i8080_step(&c);
     }
+    CHECK(ck.ended && !ck.diverged);
+    i8080_checkpoint_close(&ck);
+
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, FILL_PROGRAM, sizeof(FILL_PROGRAM));
+    CHECK(i8080_checkpoint_record(&ck, changed, 1000, &c));
+    while (c.cyc < 40000) {
+        i8080_step(&c);
+        i8080_checkpoint_tick(&ck, &c);
+        if (ck.index == 25) {
+            memory[0x3000] = 0xFF; // outside of the area filled
+        }
+    }
+    i8080_checkpoint_close(&ck);
+    CHECK(i8080_checkpoint_bisect(golden, changed) == 25);
+    CHECK(i8080_checkpoint_bisect(golden, golden) == -1);
+
+    remove(golden);
+    remove(changed);
+    return true;
+}
 
+// devices: the scheduler stops at an event the user scheduled, and gives it
+// back when it returns
+static bool test_scheduler_keeps_next_event(void) {
+    i8080 c;
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, FILL_PROGRAM, sizeof(FILL_PROGRAM));
+    i8080_port ports[256] = { 0 };
+    c.ports = ports;
+    i8080_scheduler s;
+    i8080_scheduler_init(&s, ports);
+    i8080_device d = { .run = watchdog };
+    CHECK(i8080_scheduler_add(&s, &d, &c));
+
+    c.next_event = 100000;
+    i8080_scheduler_run(&s, &c, 50000);
+    CHECK(c.next_event == 100000);
+    CHECK(c.cyc >= 50000);
+
+    c.next_event = c.cyc + 1000;
+    const unsigned long next_event = c.next_event;
+    i8080_scheduler_run(&s, &c, c.cyc + 50000);
+    CHECK(c.next_event == next_event);
+    return true;
+}
+
+// write log: reading page 0x40 has a side effect, like a memory-mapped
+// io register
+static unsigned long io_page_reads = 0;
+
+static uint8_t rb_io_page(void* userdata, uint16_t addr) {
+    io_page_reads += addr >> 8 == 0x40;
+    return memory[addr];
+}
+
+// write log: the values overwritten are never read on memory-mapped io
+// pages, and are taken from the memory view when there is one
+static bool test_writelog_old_values(void) {
+    static const uint8_t program[] = {
+        0x3E, 0x55, // MVI A,55h
+        0x32, 0x00, 0x40, // STA 4000h
+        0x32, 0x00, 0x30, // STA 3000h
+        0x76, // HLT
+    };
+    i8080_writelog w;
+    i8080_write write;
+    i8080 c;
+
+    for (int view = 0; view < 2; view++) {
+        setup_cpu(&c);
+        c.read_byte = rb_io_page;
+        memset(memory, 0, MEMORY_SIZE);
+        memcpy(memory, program, sizeof(program));
+        memory[0x4000] = 0x11;
+        memory[0x3000] = 0x22;
+        CHECK(i8080_writelog_init(&w, 16, 2));
+        w.mmio_pages[0x40 >> 5] |= 1u << (0x40 & 31);
+        w.memory = view ? memory : NULL;
+        c.write_log = &w;
+        io_page_reads = 0;
+        while (!c.halted) {
+            i8080_step(&c);
+        }
+
+        CHECK(io_page_reads == 0);
+        CHECK(i8080_writelog_last(&w, 0x4000, &write));
+        CHECK(write.old_value == (view ? 0x11 : 0x00));
+        CHECK(write.new_value == 0x55 && write.pc == 0x0002);
+        CHECK(i8080_writelog_last(&w, 0x3000, &write));
+        CHECK(write.old_value == 0x22 && write.pc == 0x0005);
+        i8080_writelog_free(&w);
+    }
+    return true;
+}
+
+// cp/m: a program printing a string, polling the console, reading a line, a
+// file record, then searching with wildcards (which ends it)
+static const uint8_t CPM_PROGRAM[] = {
+    0x11, 0x44, 0x01, // 0100: LXI D,msg
+    0x0E, 0x09, // 0103: MVI C,9 (print string)
+    0xCD, 0x05, 0x00, // 0105: CALL 5
+    0x0E, 0x0B, // 0108: MVI C,11 (console status)
+    0xCD, 0x05, 0x00, // 010A: CALL 5
+    0x32, 0x00, 0x03, // 010D: STA 0300h
+    0x11, 0x10, 0x03, // 0110: LXI D,0310h
+    0x0E, 0x0A, // 0113: MVI C,10 (read console buffer)
+    0xCD, 0x05, 0x00, // 0115: CALL 5
+    0x11, 0x00, 0x04, // 0118: LXI D,0400h
+    0x0E, 0x1A, // 011B: MVI C,26 (set DMA address)
+    0xCD, 0x05, 0x00, // 011D: CALL 5
+    0x11, 0x5C, 0x00, // 0120: LXI D,005Ch
+    0x0E, 0x0F, // 0123: MVI C,15 (open file)
+    0xCD, 0x05, 0x00, // 0125: CALL 5
+    0x32, 0x01, 0x03, // 0128: STA 0301h
+    0x11, 0x5C, 0x00, // 012B: LXI D,005Ch
+    0x0E, 0x14, // 012E: MVI C,20 (read sequential)
+    0xCD, 0x05, 0x00, // 0130: CALL 5
+    0x32, 0x02, 0x03, // 0133: STA 0302h
+    0x11, 0x6C, 0x00, // 0136: LXI D,006Ch
+    0x0E, 0x11, // 0139: MVI C,17 (search first)
+    0xCD, 0x05, 0x00, // 013B: CALL 5
+    0x32, 0x03, 0x03, // 013E: STA 0303h
+    0xC3, 0x00, 0x00, // 0141: JMP 0
+    'H', 'I', '$', // 0144: msg
+};
+
+// writes `size` bytes to a new file
+static bool write_file(const char* filename, const void* data, size_t size) {
+    FILE* f = i8080_open_file(filename, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    bool written = fwrite(data, 1, size, f) == size;
     fclose(f);
-    return 0;
+    return written;
 }
 
-static inline void run_test(
-    i8080* const c, const char* filename, unsigned long cyc_expected) {
-    i8080_init(c);
-    c->userdata = c;
-    c->read_byte = rb;
-    c->write_byte = wb;
-    c->port_in = port_in;
-    c->port_out = port_out;
+// cp/m: the BDOS writes go through the cpu (dirty pages, write log)
+static bool test_cpm_program(void) {
+    uint8_t record[128];
+    char output[16] = { 0 };
+    i8080_writelog w;
+    i8080_write write;
+    i8080_cpm cpm;
+    i8080 c;
+
+    for (int i = 0; i < 128; i++) {
+        record[i] = (uint8_t)(i * 3);
+    }
+    CHECK(write_file("cpm_test.tmp", CPM_PROGRAM, sizeof(CPM_PROGRAM)));
+    CHECK(write_file("cpmdata.tmp", record, sizeof(record)));
+    CHECK(write_file("cpm_input.tmp", "typed\n", 6));
+
+    setup_cpu(&c);
     memset(memory, 0, MEMORY_SIZE);
+    i8080_cpm_init(&cpm, &c, memory);
+    CHECK(i8080_cpm_load(&cpm, "cpm_test.tmp", "cpmdata.tmp ????????.tmp"));
+    memory[0x0310] = 16; // console buffer size
+    cpm.console = i8080_open_file("cpm_console.tmp", "w+b");
+    cpm.input = i8080_open_file("cpm_input.tmp", "rb");
+    CHECK(cpm.console != NULL && cpm.input != NULL);
+    CHECK(i8080_writelog_init(&w, 1024, 1));
+    c.write_log = &w;
 
-    if (load_file(filename, 0x100) != 0) {
-        return;
+    while (i8080_cpm_step(&cpm, &c)) {
     }
-    printf("*** TEST: %s\n", filename);
+    i8080_cpm_flush(&cpm);
+    rewind(cpm.console);
+    fread(output, 1, sizeof(output) - 1, cpm.console);
+    fclose(cpm.console);
+    fclose(cpm.input);
+    i8080_cpm_close(&cpm);
 
-    c->pc = 0x100;
+    CHECK(strcmp(output, "HItyped\r") == 0);
+    CHECK(memory[0x0300] == 0xFF); // input ready (a file)
+    CHECK(memory[0x0311] == 5 && memcmp(&memory[0x0312], "typed", 5) == 0);
+    CHECK(memory[0x0301] == 0 && memory[0x0302] == 0);
+    CHECK(memcmp(&memory[0x0400], record, sizeof(record)) == 0);
+    CHECK(c.pc == 0x0005 && memory[0x0303] == 0); // ended by the search
+    CHECK(c.dirty_pages[0] & (1u << 0x04));
+    CHECK(i8080_writelog_last(&w, 0x0400, &write) && write.pc == 0x0130);
+    CHECK(i8080_writelog_last(&w, 0x0312, &write) && write.pc == 0x0115);
+    i8080_writelog_free(&w);
 
-    // inject "out 0,a" at 0x0000 (signal to stop the test)
-    memory[0x0000] = 0xD3;
-    memory[0x0001] = 0x00;
+    remove("cpm_test.tmp");
+    remove("cpmdata.tmp");
+    remove("cpm_input.tmp");
+    remove("cpm_console.tmp");
+    return true;
+}
 
-    // inject "out 1,a" at 0x0005 (signal to output some characters)
-    memory[0x0005] = 0xD3;
-    memory[0x0006] = 0x01;
-    memory[0x0007] = 0xC9;
+// hooks: a native handler setting B, standing for a routine of 10 cycles
+static unsigned long set_b(i8080* c, void* userdata) {
+    c->b = 0x42;
+    return 10;
+}
 
-    long nb_instructions = 0;
+// hooks: a halted cpu never runs the hook of the next address, and a hook
+// on the second opcode of a fused pair is run
+static bool test_hooks_halted_and_fused(void) {
+    static i8080_hooks hooks;
+    static i8080_fusion f;
+    i8080 c;
 
-    test_finished = 0;
-    while (!test_finished) {
-        nb_instructions += 1;
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memory[0x0100] = 0x76; // HLT
+    i8080_hooks_init(&hooks);
+    i8080_hook* const h = i8080_hooks_add(&hooks, 0x0101, set_b, NULL, 0);
+    c.hooks = &hooks;
+    c.pc = 0x0100;
+    c.sp = 0x2000;
+    for (int i = 0; i < 10; i++) {
+        i8080_step(&c);
+    }
+    CHECK(c.halted && c.pc == 0x0101 && c.sp == 0x2000);
+    CHECK(h->calls == 0 && c.b == 0x00);
 
-        // uncomment following line to have a debug output of machine state
-        // warning: will output multiple GB of data for the whole test suite
-        // i8080_debug_output(c, false);
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x20, // LXI SP,2000h
+        0x21, 0x0C, 0x00, // LXI H,end
+        0xE5, // PUSH H (the hooked routine returns to end)
+        0xFE, 0x05, // CPI 5
+        0xCA, 0x00, 0x00, // JZ 0, hooked
+        0x76, // end: HLT
+    };
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, program, sizeof(program));
+    i8080_hooks_init(&hooks);
+    i8080_hooks_add(&hooks, 0x0009, set_b, NULL, 0);
+    c.hooks = &hooks;
+    i8080_fusion_init(&f);
+    i8080_fusion_enable(&f, 0xFE, 0xCA); // CPI / JZ
+    c.fusion = &f;
+    while (!c.halted) {
+        i8080_step(&c);
+    }
+    CHECK(c.b == 0x42 && c.pc == 0x000D && f.fused == 0);
+    return true;
+}
 
+// hooks: copies B bytes from (DE) to (HL), like the routine at 0x0200 below
+// (whose cost, 39 cycles per byte, is left to be measured)
+static unsigned long block_copy(i8080* c, void* userdata) {
+    uint16_t de = c->d << 8 | c->e;
+    uint16_t hl = c->h << 8 | c->l;
+    do {
+        c->a = i8080_hooks_read(c, de++);
+        i8080_hooks_write(c, hl++, c->a);
+    } while (--c->b != 0);
+    c->d = de >> 8;
+    c->e = de & 0xFF;
+    c->h = hl >> 8;
+    c->l = hl & 0xFF;
+    c->sf = 0; // flags of the last DCR B
+    c->zf = 1;
+    c->hf = 1;
+    c->pf = 1;
+    return 1;
+}
+
+// copies of 4 and 8 bytes, twice from the same registers, through the
+// routine at 0x0200
+static void run_block_copies(i8080* const c, i8080_hooks* const hooks) {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x20, // LXI SP,2000h
+        0xAF, // XRA A
+        0x06, 0x04, // MVI B,4
+        0x11, 0x00, 0x10, // LXI D,1000h
+        0x21, 0x00, 0x11, // LXI H,1100h
+        0xCD, 0x00, 0x02, // CALL copy
+        0xAF, // XRA A
+        0x06, 0x08, // MVI B,8
+        0x11, 0x00, 0x10, // LXI D,1000h
+        0x21, 0x00, 0x12, // LXI H,1200h
+        0xCD, 0x00, 0x02, // CALL copy
+        0x3A, 0x00, 0x13, // LDA 1300h
+        0x3C, // INR A
+        0x32, 0x00, 0x13, // STA 1300h
+        0xFE, 0x02, // CPI 2
+        0xC2, 0x03, 0x00, // JNZ 0003h
+        0x76, // HLT
+    };
+    static const uint8_t copy[] = {
+        0x1A, // copy: LDAX D
+        0x77, // MOV M,A
+        0x13, // INX D
+        0x23, // INX H
+        0x05, // DCR B
+        0xC2, 0x00, 0x02, // JNZ copy
+        0xC9, // RET
+    };
+    setup_cpu(c);
+    c->hooks = hooks;
+    memset(memory, 0, MEMORY_SIZE);
+    memcpy(memory, program, sizeof(program));
+    memcpy(memory + 0x0200, copy, sizeof(copy));
+    for (int i = 0; i < 16; i++) {
+        memory[0x1000 + i] = (uint8_t)(0xA0 + i);
+    }
+    while (!c->halted) {
         i8080_step(c);
     }
+}
 
-    long long diff = cyc_expected - c->cyc;
-    printf("\n*** %lu instructions executed on %lu cycles"
-        " (expected=%lu, diff=%lld)\n\n",
-        nb_instructions, c->cyc, cyc_expected, diff);
+// hooks: a measured routine is charged the cost of its own length
+static bool test_hooks_measure(void) {
+    static uint8_t interpreted_memory[MEMORY_SIZE];
+    static i8080_hooks hooks;
+    i8080 interpreted, hooked;
+
+    run_block_copies(&interpreted, NULL);
+    memcpy(interpreted_memory, memory, MEMORY_SIZE);
+
+    i8080_hooks_init(&hooks);
+    hooks.report = NULL;
+    i8080_hook* const h = i8080_hooks_add(&hooks, 0x0200, block_copy, NULL,
+        I8080_HOOK_MEASURE);
+    run_block_copies(&hooked, &hooks);
+    i8080_hooks_free(&hooks);
+
+    CHECK(h->calls == 4 && h->validations == 2 && h->mismatches == 0);
+    CHECK(same_registers(&interpreted, &hooked));
+    CHECK(memcmp(interpreted_memory, memory, MEMORY_SIZE) == 0);
+    return true;
 }
 
-int main(void) {
+// idioms: writes at 0x0100 a random copy or fill loop (sometimes with an
+// instruction that is not part of the idioms), followed by a HLT
+static void write_random_loop(void) {
+    static const uint8_t loads[] = { 0x0A, 0x1A, 0x7E }; // LDAX B/D, MOV A,M
+    static const uint8_t stores[] = { 0x02, 0x12, 0x77 }; // STAX B/D, MOV M,A
+    static const uint8_t incs[] = { 0x03, 0x13, 0x23 }; // INX B/D/H
+    static const uint8_t decs[] = { 0x05, 0x0D, 0x15, 0x1D }; // DCR B/C/D/E
+    uint16_t addr = 0x0100;
+    int load, store, counter;
+
+    do {
+        load = rand() % 4 - 1; // -1: none (a fill)
+        store = rand() % 3;
+        counter = rand() % 4;
+    } while (load == store || counter >> 1 == load || counter >> 1 == store);
+
+    if (load >= 0) {
+        memory[addr++] = loads[load];
+    }
+    if (load < 0 && store == 2 && rand() % 2 == 0) {
+        memory[addr++] = 0x36; // MVI M,byte
+        memory[addr++] = (uint8_t)rand();
+    }
+    else {
+        memory[addr++] = stores[store];
+    }
+    if (rand() % 8 == 0) {
+        memory[addr++] = 0x3C; // INR A
+    }
+    if (load >= 0) {
+        memory[addr++] = incs[load];
+    }
+    memory[addr++] = incs[store];
+    memory[addr++] = decs[counter];
+    memory[addr++] = 0xC2; // JNZ 0100h
+    memory[addr++] = 0x00;
+    memory[addr++] = 0x01;
+    memory[addr] = 0x76; // HLT
+}
+
+// idioms: runs the random loop from random registers and data, batched or
+// not, with an event somewhere in it
+static void run_random_loop(i8080* const c, i8080_idioms* const m,
+    unsigned seed) {
+    srand(seed);
+    memset(memory, 0, MEMORY_SIZE);
+    write_random_loop();
+    for (int i = 0x4000; i < 0xC000; i++) {
+        memory[i] = (uint8_t)rand();
+    }
+
+    setup_cpu(c);
+    c->idioms = m;
+    c->pc = 0x0100;
+    c->b = (uint8_t)(0x40 + rand() % 0x7F); // pairs in 4000h-BEFFh
+    c->c = (uint8_t)rand();
+    c->d = (uint8_t)(0x40 + rand() % 0x7F);
+    c->e = (uint8_t)rand();
+    c->h = (uint8_t)(0x40 + rand() % 0x7F);
+    c->l = (uint8_t)rand();
+    c->a = (uint8_t)rand();
+    c->next_event = rand() % 2 ? 1 + rand() % 20000 : 0;
+    while (!c->halted) {
+        i8080_step(c);
+    }
+}
+
+// idioms: random loops give the same state, memory and counters batched as
+// run one instruction at a time
+static bool test_idioms_random_loops(void) {
+    static uint8_t interpreted_memory[MEMORY_SIZE];
+    static i8080_idioms m;
+    i8080 interpreted, batched;
+
+    i8080_idioms_init(&m);
+    CHECK(!i8080_idioms_map(&m, 0x0080, 0x100, memory, true));
+    CHECK(!i8080_idioms_map(&m, 0x0000, 0x180, memory, true));
+    CHECK(!i8080_idioms_map(&m, 0xFF00, 0x200, memory, true));
+    CHECK(i8080_idioms_map(&m, 0x0000, MEMORY_SIZE, memory, true));
+
+    for (unsigned seed = 1; seed <= 300; seed++) {
+        run_random_loop(&interpreted, NULL, seed);
+        memcpy(interpreted_memory, memory, MEMORY_SIZE);
+        run_random_loop(&batched, &m, seed);
+
+        CHECK(same_registers(&interpreted, &batched));
+        CHECK(memcmp(interpreted_memory, memory, MEMORY_SIZE) == 0);
+#ifdef I8080_STATS
+        CHECK(memcmp(&interpreted.stats, &batched.stats,
+            sizeof(interpreted.stats)) == 0);
+#endif
+    }
+    CHECK(m.loops > 0);
+    return true;
+}
+
+#ifdef I8080_STATS
+// stats: a request overwriting a pending one is timed from the first one
+static bool test_latency_of_overwritten_request(void) {
+    i8080 c;
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE); // NOPs
+    memory[0x0000] = 0xF3; // DI
+    memory[0x0030] = 0xFB; // EI
+
+    while (c.cyc < 40) {
+        i8080_step(&c);
+    }
+    unsigned long first_request = c.cyc;
+    i8080_interrupt(&c, 0xCF); // RST 1
+    while (c.cyc < 80) {
+        i8080_step(&c);
+    }
+    i8080_interrupt(&c, 0xD7); // RST 2, replaces it
+
+    unsigned long serviced = c.cyc;
+    while (c.stats.interrupts_serviced == 0 && c.cyc < 1000) {
+        serviced = c.cyc;
+        i8080_step(&c);
+    }
+    CHECK(c.stats.interrupts_overwritten == 1);
+    CHECK(c.stats.interrupt_latency[1].count == 0);
+    CHECK(c.stats.interrupt_latency[2].count == 1);
+    CHECK(c.stats.interrupt_latency[2].total == serviced - first_request);
+    return true;
+}
+// stats: an interrupt ending a HLT waits for what the run loop adds to the
+// cycle count, and the percentiles are bucket bounds
+static bool test_latency_halted_and_percentile(void) {
+    i8080 c;
+    setup_cpu(&c);
+    memset(memory, 0, MEMORY_SIZE);
+    memory[0x0000] = 0xFB; // EI
+    memory[0x0001] = 0x76; // HLT
+    memory[0x0008] = 0xFB; // RST 1: EI
+    memory[0x0009] = 0x76; // HLT
+
+    for (int i = 0; i < 10; i++) {
+        i8080_step(&c);
+    }
+    CHECK(c.halted && c.stats.halted_steps == 8);
+    i8080_interrupt(&c, 0xCF); // RST 1
+    i8080_step(&c);
+    CHECK(c.stats.interrupt_latency[1].count == 1);
+    CHECK(c.stats.interrupt_latency[1].total == 0);
+
+    while (!c.halted) {
+        i8080_step(&c);
+    }
+    i8080_interrupt(&c, 0xCF);
+    c.cyc += 100; // a run loop skipping to its next stop
+    i8080_step(&c);
+    CHECK(c.stats.interrupt_latency[1].count == 2);
+    CHECK(c.stats.interrupt_latency[1].total == 100);
+
+    i8080_latency l = { 0 };
+    l.count = 10;
+    l.buckets[2] = 9; // 5 cycles, nine times
+    l.buckets[6] = 1; // 100 cycles
+    l.total = 9 * 5 + 100;
+    l.max = 100;
+    CHECK(i8080_latency_percentile(&l, 0.5) == 7);
+    CHECK(i8080_latency_percentile(&l, 0.9) == 7);
+    CHECK(i8080_latency_percentile(&l, 1.0) == 100);
+    return true;
+}
+#endif
+
+int main(int argc, char** argv) {
     memory = malloc(MEMORY_SIZE);
     if (memory == NULL) {
         return 1;
@@ -127,8 +976,32 @@ int main(void) {
 
     i8080 cpu;
     run_test(&cpu, "TST8080.COM", 4924LU);
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        run_device_benchmark(&cpu);
+    }
+
+    run_unit_test("rewind round trip", test_rewind_round_trip);
+    run_unit_test("io input, one value per read",
+        test_io_input_one_value_per_read);
+    run_unit_test("fused and unfused pairs", test_fusion_differential);
+    run_unit_test("checkpoint record then compare",
+        test_checkpoint_record_compare);
+    run_unit_test("scheduler keeps the user event",
+        test_scheduler_keeps_next_event);
+    run_unit_test("write log old values", test_writelog_old_values);
+    run_unit_test("cp/m program", test_cpm_program);
+    run_unit_test("hooks, halted cpu and fused pair",
+        test_hooks_halted_and_fused);
+    run_unit_test("hooks, measured costs", test_hooks_measure);
+    run_unit_test("idioms, random loops", test_idioms_random_loops);
+#ifdef I8080_STATS
+    run_unit_test("latency of an overwritten request",
+        test_latency_of_overwritten_request);
+    run_unit_test("latency of a halted cpu, percentiles",
+        test_latency_halted_and_percentile);
+#endif
 
     free(memory);
 
-    return 0;
+    return nb_failures > 0 ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+// Memory write history. The core calls i8080_writelog_record for each byte it
+// writes (before writing it); each write is linked to the previous write to
+// the same address, and a table holds the last write per address, so the
+// last writer of an address is found with one lookup and its history by
+// following the links, whatever the length of the run.
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8080_writelog.h"
+
+#define MEMORY_SIZE 0x10000
+
+// initialises an empty log. Its memory use is bounded by
+// chunk_writes * max_chunks * sizeof(i8080_write) (plus a 512 KiB index).
+bool i8080_writelog_init(
+    i8080_writelog* const w, size_t chunk_writes, size_t max_chunks) {
+    memset(w, 0, sizeof(*w));
+    w->chunk_writes = chunk_writes > 0 ? chunk_writes : 1;
+    w->max_chunks = max_chunks > 0 ? max_chunks : 1;
+    // the first write starts a new chunk, the first one
+    w->current = w->max_chunks - 1;
+    w->pos = w->chunk_writes;
+
+    w->chunks = calloc(w->max_chunks, sizeof(*w->chunks));
+    w->last = calloc(MEMORY_SIZE, sizeof(*w->last));
+    if (w->chunks == NULL || w->last == NULL) {
+        i8080_writelog_free(w);
+        return false;
+    }
+    return true;
+}
+
+void i8080_writelog_free(i8080_writelog* const w) {
+    if (w->chunks != NULL) {
+        for (size_t i = 0; i < w->max_chunks; i++) {
+            free(w->chunks[i]);
+        }
+    }
+    free(w->chunks);
+    free(w->last);
+    w->chunks = NULL;
+    w->last = NULL;
+}
+
+// returns the write numbered `seq` (which must be kept in the log)
+static const i8080_write* get(const i8080_writelog* const w, uint64_t seq) {
+    size_t chunk = (size_t)((seq / w->chunk_writes) % w->max_chunks);
+    return &w->chunks[chunk][seq % w->chunk_writes];
+}
+
+// records a write of `val` at `addr` by the current instruction of the cpu
+void i8080_writelog_record(
+    i8080_writelog* const w, i8080* const c, uint16_t addr, uint8_t val) {
+    if (w->pos == w->chunk_writes) {
+        size_t chunk = (w->current + 1) % w->max_chunks;
+        if (w->chunks[chunk] == NULL) {
+            w->chunks[chunk] = malloc(w->chunk_writes * sizeof(i8080_write));
+            if (w->chunks[chunk] == NULL) {
+                w->dropped += 1;
+                return;
+            }
+        }
+        if (w->next - w->first >= w->chunk_writes * w->max_chunks) {
+            w->first += w->chunk_writes; // evicts the oldest chunk
+        }
+        w->current = chunk;
+        w->pos = 0;
+    }
+
+    i8080_write* const write = &w->chunks[w->current][w->pos++];
+    uint64_t last = w->last[addr];
+    write->cyc = c->cyc;
+    write->prev = last != 0 && w->next - (last - 1) <= UINT32_MAX ?
+        (uint32_t)(w->next - (last - 1)) : 0;
+    write->pc = c->inst_pc;
+    write->addr = addr;
+    if (w->memory != NULL) {
+        write->old_value = w->memory[addr];
+    }
+    else if (w->mmio_pages[addr >> 13] & (1u << ((addr >> 8) & 31))) {
+        write->old_value = 0;
+    }
+    else {
+        write->old_value = c->read_byte(c->userdata, addr);
+    }
+    write->new_value = val;
+
+    w->next += 1;
+    w->last[addr] = w->next;
+}
+
+// finds the last write to `addr`. Returns false if there is none in the log.
+bool i8080_writelog_last(
+    const i8080_writelog* const w, uint16_t addr, i8080_write* const write) {
+    uint64_t last = w->last[addr];
+    if (last == 0 || last - 1 < w->first) {
+        return false;
+    }
+    *write = *get(w, last - 1);
+    return true;
+}
+
+// copies up to `max_writes` writes to `addr` into `writes`, the most recent
+// first, and returns their number
+size_t i8080_writelog_history(const i8080_writelog* const w, uint16_t addr,
+    i8080_write* writes, size_t max_writes) {
+    uint64_t last = w->last[addr];
+    size_t count = 0;
+
+    if (last == 0) {
+        return 0;
+    }
+
+    uint64_t seq = last - 1;
+    while (count < max_writes && seq >= w->first) {
+        const i8080_write* const write = get(w, seq);
+        writes[count++] = *write;
+        if (write->prev == 0 || write->prev > seq) {
+            break;
+        }
+        seq -= write->prev;
+    }
+    return count;
+}
+
+// forgets the writes done after cycle `cyc` (e.g. after a rewind)
+void i8080_writelog_truncate(i8080_writelog* const w, unsigned long cyc) {
+    while (w->next > w->first) {
+        const i8080_write* const write = get(w, w->next - 1);
+        if ((long)(write->cyc - cyc) <= 0) {
+            break;
+        }
+        w->next -= 1;
+        w->last[write->addr] = write->prev != 0 ? w->next - write->prev + 1 : 0;
+    }
+
+    if (w->next == 0) {
+        w->current = w->max_chunks - 1;
+        w->pos = w->chunk_writes;
+    }
+    else {
+        w->current = (size_t)(((w->next - 1) / w->chunk_writes) % w->max_chunks);
+        w->pos = (size_t)((w->next - 1) % w->chunk_writes) + 1;
+    }
+}
+
+#undef MEMORY_SIZE
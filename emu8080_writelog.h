@@ -0,0 +1,51 @@
+#ifndef I8080_WRITELOG_H_
+#define I8080_WRITELOG_H_
+
+#include "emu8080.h"
+
+// one memory write done by the cpu
+typedef struct i8080_write {
+	unsigned long cyc; // cycle count at the time of the write
+	// number of writes back to the previous write to the same address (0:
+	// none, or too far back)
+	uint32_t prev;
+	uint16_t pc; // address of the instruction that wrote
+	uint16_t addr;
+	uint8_t old_value, new_value;
+} i8080_write;
+
+// history of the memory writes, indexed by address: attach it to the cpu
+// (`write_log`) and every write is recorded with the instruction that did it.
+// Writes are numbered from 0 in the order they happen and stored in chunks of
+// `chunk_writes`; once `max_chunks` chunks are used, the oldest one is
+// dropped as a whole. The value overwritten is read from `memory` if set,
+// through read_byte otherwise, except on the pages flagged in `mmio_pages`
+// where reading could have side effects (it is then recorded as 0).
+typedef struct i8080_writelog {
+	size_t chunk_writes; // writes per chunk
+	size_t max_chunks;
+	i8080_write** chunks; // ring of chunks, allocated when first needed
+	size_t current; // chunk being filled
+	size_t pos; // next slot in the current chunk
+	uint64_t first; // number of the oldest write kept
+	uint64_t next; // number of the next write
+	uint64_t* last; // per address: number of the last write + 1 (0: none)
+	uint64_t dropped; // writes not recorded (out of memory)
+	// optional view of the 64 KiB of memory, where the values overwritten are
+	// read instead of through read_byte
+	const uint8_t* memory;
+	uint32_t mmio_pages[256 / 32]; // pages with memory-mapped io (never read)
+} i8080_writelog;
+
+bool i8080_writelog_init(i8080_writelog* const w, size_t chunk_writes,
+	size_t max_chunks);
+void i8080_writelog_free(i8080_writelog* const w);
+void i8080_writelog_record(i8080_writelog* const w, i8080* const c,
+	uint16_t addr, uint8_t val);
+bool i8080_writelog_last(const i8080_writelog* const w, uint16_t addr,
+	i8080_write* const write);
+size_t i8080_writelog_history(const i8080_writelog* const w, uint16_t addr,
+	i8080_write* writes, size_t max_writes);
+void i8080_writelog_truncate(i8080_writelog* const w, unsigned long cyc);
+
+#endif // I8080_WRITELOG_H_